@@ -1,20 +1,233 @@
 #include <iostream>
 #include <string>
+#include <string_view>
+#include <charconv>
+#include <system_error>
 #include <vector>
 #include <sstream>
 #include <cctype>
 #include <stack>
 #include <queue>
 #include <map>
+#include <set>
 #include <cmath>
 #include <iomanip>
+#include <algorithm>
+#include <stdexcept>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <limits>
+#include <chrono>
+#include <random>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
 #include <list>
+#include <memory>
+#include <new>
+#include <fstream>
+#include <functional>
+#include <future>
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#endif
+#include <unordered_map>
+#include <cstring>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define CALCULATOR_HAVE_IO_URING 1
+#else
+#define CALCULATOR_HAVE_IO_URING 0
+#endif
+#if __has_include(<linux/perf_event.h>)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#define CALCULATOR_HAVE_PERF_EVENT 1
+#else
+#define CALCULATOR_HAVE_PERF_EVENT 0
+#endif
+#else
+#define CALCULATOR_HAVE_PERF_EVENT 0
+#endif
+
+// Builds with -DCALCULATOR_TRACK_ALLOCATIONS=1 replace the global operator
+// new and delete to count allocations; see AllocationTracker.
+#ifndef CALCULATOR_TRACK_ALLOCATIONS
+#define CALCULATOR_TRACK_ALLOCATIONS 0
+#endif
+
+// Pipeline stages that allocation tracking charges memory traffic to.
+enum class PipelineStage { OTHER, TOKENIZE, INLINE, PARSE, EVALUATE, COUNT };
+
+// Allocations charged to one stage, over all threads.
+struct AllocationStatistics {
+    uint64_t allocations = 0;
+    uint64_t bytes = 0;
+    uint64_t peakLiveBytes = 0;  // Most bytes one scope of the stage held at once.
+};
+
+// AllocationTracker counts the allocations made through operator new in
+// builds with CALCULATOR_TRACK_ALLOCATIONS. Code marks the stage it is in
+// with a Scope; an allocation is charged to the innermost scope of its
+// thread, or to OTHER outside any. A scope's live bytes are what it
+// allocated minus what it freed, and what an inner scope still holds when it
+// ends counts for the outer one. In other builds scopes compile to nothing
+// and the statistics stay zero.
+class AllocationTracker {
+public:
+    static constexpr bool enabled = CALCULATOR_TRACK_ALLOCATIONS != 0;
+
+    class Scope {
+    public:
+        explicit Scope(PipelineStage stage) {
+#if CALCULATOR_TRACK_ALLOCATIONS
+            previousStage = currentStage;
+            previousLive = liveBytes;
+            currentStage = stage;
+            liveBytes = 0;
+#else
+            (void)stage;
+#endif
+        }
+
+        ~Scope() {
+#if CALCULATOR_TRACK_ALLOCATIONS
+            currentStage = previousStage;
+            liveBytes += previousLive;
+#endif
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+#if CALCULATOR_TRACK_ALLOCATIONS
+    private:
+        PipelineStage previousStage;
+        int64_t previousLive;
+#endif
+    };
+
+    static AllocationStatistics statistics(PipelineStage stage) {
+        AllocationStatistics result;
+#if CALCULATOR_TRACK_ALLOCATIONS
+        const Counters& counter = counters[static_cast<int>(stage)];
+        result.allocations = counter.allocations.load(std::memory_order_relaxed);
+        result.bytes = counter.bytes.load(std::memory_order_relaxed);
+        result.peakLiveBytes = counter.peakLiveBytes.load(std::memory_order_relaxed);
+#else
+        (void)stage;
+#endif
+        return result;
+    }
+
+    // Evaluations so far, for averages per evaluation; evaluateInMode counts them.
+    static uint64_t evaluations() { return evaluationCount.load(std::memory_order_relaxed); }
+    static void countEvaluation() {
+        if (enabled) evaluationCount.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static void reset() {
+#if CALCULATOR_TRACK_ALLOCATIONS
+        for (Counters& counter : counters) {
+            counter.allocations.store(0, std::memory_order_relaxed);
+            counter.bytes.store(0, std::memory_order_relaxed);
+            counter.peakLiveBytes.store(0, std::memory_order_relaxed);
+        }
+#endif
+        evaluationCount.store(0, std::memory_order_relaxed);
+    }
+
+#if CALCULATOR_TRACK_ALLOCATIONS
+    // Called by the replaced operators; they must not allocate.
+    static void allocated(size_t bytes) {
+        Counters& counter = counters[static_cast<int>(currentStage)];
+        counter.allocations.fetch_add(1, std::memory_order_relaxed);
+        counter.bytes.fetch_add(bytes, std::memory_order_relaxed);
+        liveBytes += static_cast<int64_t>(bytes);
+        uint64_t live = static_cast<uint64_t>(std::max<int64_t>(liveBytes, 0));
+        uint64_t peak = counter.peakLiveBytes.load(std::memory_order_relaxed);
+        while (live > peak && !counter.peakLiveBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+        }
+    }
+
+    static void released(size_t bytes) { liveBytes -= static_cast<int64_t>(bytes); }
+
+private:
+    struct Counters {  // Zero-initialized, as only static instances exist.
+        std::atomic<uint64_t> allocations;
+        std::atomic<uint64_t> bytes;
+        std::atomic<uint64_t> peakLiveBytes;
+    };
+
+    static inline Counters counters[static_cast<int>(PipelineStage::COUNT)];
+    static inline thread_local PipelineStage currentStage = PipelineStage::OTHER;
+    static inline thread_local int64_t liveBytes = 0;  // Net bytes of this thread's innermost scope.
+#else
+private:
+#endif
+    static inline std::atomic<uint64_t> evaluationCount{0};
+};
+
+#if CALCULATOR_TRACK_ALLOCATIONS
+// The replaced operators keep each block's size just before it, in a header
+// that also keeps the block aligned, so delete can report how much it frees.
+namespace {
+void* trackedAllocate(size_t size, size_t alignment) {
+    size_t header = std::max(alignment, alignof(std::max_align_t));
+    size_t total = (size + header + alignment - 1) / alignment * alignment;
+    char* base = static_cast<char*>(alignment > alignof(std::max_align_t) ? std::aligned_alloc(alignment, total)
+                                                                          : std::malloc(total));
+    if (!base) throw std::bad_alloc();
+    std::memcpy(base + header - sizeof(size_t), &size, sizeof(size_t));
+    AllocationTracker::allocated(size);
+    return base + header;
+}
+
+void trackedRelease(void* pointer, size_t alignment) {
+    if (!pointer) return;
+    size_t size;
+    std::memcpy(&size, static_cast<char*>(pointer) - sizeof(size_t), sizeof(size_t));
+    AllocationTracker::released(size);
+    std::free(static_cast<char*>(pointer) - std::max(alignment, alignof(std::max_align_t)));
+}
+}  // namespace
+
+void* operator new(size_t size) { return trackedAllocate(size, alignof(std::max_align_t)); }
+void* operator new[](size_t size) { return trackedAllocate(size, alignof(std::max_align_t)); }
+void* operator new(size_t size, std::align_val_t alignment) { return trackedAllocate(size, static_cast<size_t>(alignment)); }
+void* operator new[](size_t size, std::align_val_t alignment) { return trackedAllocate(size, static_cast<size_t>(alignment)); }
+void operator delete(void* pointer) noexcept { trackedRelease(pointer, alignof(std::max_align_t)); }
+void operator delete[](void* pointer) noexcept { trackedRelease(pointer, alignof(std::max_align_t)); }
+void operator delete(void* pointer, size_t) noexcept { trackedRelease(pointer, alignof(std::max_align_t)); }
+void operator delete[](void* pointer, size_t) noexcept { trackedRelease(pointer, alignof(std::max_align_t)); }
+void operator delete(void* pointer, std::align_val_t alignment) noexcept { trackedRelease(pointer, static_cast<size_t>(alignment)); }
+void operator delete[](void* pointer, std::align_val_t alignment) noexcept { trackedRelease(pointer, static_cast<size_t>(alignment)); }
+void operator delete(void* pointer, size_t, std::align_val_t alignment) noexcept { trackedRelease(pointer, static_cast<size_t>(alignment)); }
+void operator delete[](void* pointer, size_t, std::align_val_t alignment) noexcept { trackedRelease(pointer, static_cast<size_t>(alignment)); }
+#endif
 
 // Define token types for different elements in an arithmetic expression.
 enum class TokenType {
     NUMBER,
     OPERATOR,
     PARENTHESIS,
+    IDENTIFIER,  // Names of user-defined functions and their parameters.
+    SEPARATOR,   // The ',' between function arguments.
     INVALID  // Represents invalid input or tokens.
 };
 
@@ -22,26 +235,112 @@ enum class TokenType {
 struct Token {
     std::string value;  // The actual string value of the token.
     TokenType type;     // The type of token (e.g., NUMBER, OPERATOR).
+    bool isInteger = false;  // True for whole NUMBER tokens: decimal digits only, or 0x and hex digits.
+    double number = 0.0;     // Value of a NUMBER token, converted by the tokenizer.
+    // Set by reduceConstantDivisors on a "/" or "%" whose divisor is a literal:
+    bool constantDivisor = false;    // The divisor is known to be nonzero.
+    uint8_t divisorShift = 0;        // Integer mode: shift for divisorMultiplier, 0 if unused.
+    uint64_t divisorMultiplier = 0;  // Integer mode: replaces division by the divisor's magnitude.
+    // Set by resolveExponents on a "^" in modular mode:
+    bool exactExponent = false;  // exponent is the true value of the right operand.
+    uint64_t exponent = 0;
+};
+
+// Whether number literal text is written in hex ("0xFF", "0x1.8p3").
+bool isHexLiteral(const std::string& text) {
+    return text.size() > 1 && (text[1] == 'x' || text[1] == 'X');
+}
+
+// The value of a decimal or hex digit.
+unsigned digitValue(char c) {
+    return c <= '9' ? static_cast<unsigned>(c - '0') : static_cast<unsigned>(std::tolower(static_cast<unsigned char>(c)) - 'a' + 10);
+}
+
+// CancellationToken lets the caller of an evaluation abandon it. Copies share
+// one flag, so the caller keeps a copy and calls cancel() on it.
+class CancellationToken {
+public:
+    CancellationToken() : flag(std::make_shared<std::atomic<bool>>(false)) {}
+
+    void cancel() const { flag->store(true, std::memory_order_relaxed); }
+    bool isCancelled() const { return flag->load(std::memory_order_relaxed); }
+
+    // Abort the current evaluation if cancel() has been called.
+    void check() const {
+        if (isCancelled()) {
+            throw std::runtime_error("Error: Evaluation cancelled");
+        }
+    }
+
+private:
+    std::shared_ptr<std::atomic<bool>> flag;
+};
+
+// EvaluationBudget bounds the work spent on one expression. The tokenize,
+// parse and evaluate loops call step() once per iteration; it counts
+// operations against maxOperations and, every checkInterval steps, looks at
+// the clock and the cancellation token. Each limit aborts with its own error.
+class EvaluationBudget {
+public:
+    static constexpr uint64_t checkInterval = 1024;
+
+    EvaluationBudget(uint64_t maxOperations, uint64_t timeoutMilliseconds,
+                     const CancellationToken* cancellation = nullptr)
+        : maxOperations(maxOperations ? maxOperations : std::numeric_limits<uint64_t>::max()),
+          hasDeadline(timeoutMilliseconds > 0),
+          deadline(std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMilliseconds)),
+          cancellation(cancellation) {}
+
+    // True if any limit is set, i.e. the loops need to call step() at all.
+    bool isLimited() const {
+        return maxOperations != std::numeric_limits<uint64_t>::max() || hasDeadline || cancellation;
+    }
+
+    void step() {
+        if (++operations > maxOperations) {
+            throw std::runtime_error("Error: Operation budget exceeded");
+        }
+        if (operations % checkInterval == 0) {
+            check();
+        }
+    }
+
+    // Check the deadline and cancellation now, e.g. between stages.
+    void check() const {
+        if (cancellation) {
+            cancellation->check();
+        }
+        if (hasDeadline && std::chrono::steady_clock::now() > deadline) {
+            throw std::runtime_error("Error: Evaluation timed out");
+        }
+    }
+
+private:
+    uint64_t operations = 0;
+    uint64_t maxOperations;
+    bool hasDeadline;
+    std::chrono::steady_clock::time_point deadline;
+    const CancellationToken* cancellation;
 };
 
 // EnhancedTokenizer class is responsible for breaking up the input string into tokens.
 class EnhancedTokenizer {
 public:
-    // Tokenize the input expression into a series of tokens.
-    std::vector<Token> tokenize(const std::string& expression) {
+    // Tokenize the input expression into a series of tokens. With a budget,
+    // every character read counts as one operation. Malformed number literals
+    // such as "1.2.3" or "1e" throw a runtime_error.
+    std::vector<Token> tokenize(const std::string& expression, EvaluationBudget* budget = nullptr) {
         std::vector<Token> tokens;  // Stores the resulting tokens.
-        std::istringstream iss(expression);
-        char c;
         bool mayBeUnary = true;  // Flag to check if an operator can be unary.
 
-        while (iss >> c) {  // Iterating character by character through the expression.
-            if (std::isdigit(c) || c == '.') {  // Check if the character is part of a number.
-                std::string number(1, c);  // Start building the number string.
-                // Continue reading characters if they are digits or a decimal point.
-                while (iss.peek() != EOF && (std::isdigit(iss.peek()) || iss.peek() == '.')) {
-                    number += iss.get();
-                }
-                tokens.push_back(Token{number, TokenType::NUMBER});  // Add number token.
+        for (size_t i = 0; i < expression.size(); ++i) {  // Iterating character by character through the expression.
+            if (budget) budget->step();
+            char c = expression[i];
+            if (std::isdigit(static_cast<unsigned char>(c)) || (c == '.' && i + 1 < expression.size() && std::isdigit(static_cast<unsigned char>(expression[i + 1])))) {
+                // Number literal, converted here so later stages never re-parse it.
+                Token token{"", TokenType::NUMBER};
+                i += scanNumber(expression, i, token) - 1;
+                tokens.push_back(std::move(token));  // Add number token.
                 mayBeUnary = false;  // After a number, an operator cannot be unary.
             } else if (isOperator(c)) {  // Check if the character is an operator.
                 if (c == '-' && mayBeUnary) {  // Unary minus handling.
@@ -52,10 +351,29 @@ public:
                     tokens.push_back(Token{std::string(1, c), TokenType::OPERATOR});
                 }
                 mayBeUnary = true;  // Reset the flag as next operator can be unary.
+            } else if (c == '<' || c == '>' || c == '=' || c == '!') {  // Comparison operators.
+                bool withEquals = i + 1 < expression.size() && expression[i + 1] == '=';
+                if ((c == '=' || c == '!') && !withEquals) {
+                    return std::vector<Token>{{std::string(1, c), TokenType::INVALID}};  // Lone '=' or '!'.
+                }
+                tokens.push_back(Token{expression.substr(i, withEquals ? 2 : 1), TokenType::OPERATOR});
+                i += withEquals;
+                mayBeUnary = true;  // "x < -1" negates the right side.
+            } else if (std::isalpha(static_cast<unsigned char>(c)) || c == '_') {  // Names of functions and parameters.
+                size_t end = i + 1;
+                while (end < expression.size() && (std::isalnum(static_cast<unsigned char>(expression[end])) || expression[end] == '_')) {
+                    ++end;
+                }
+                tokens.push_back(Token{expression.substr(i, end - i), TokenType::IDENTIFIER});
+                i = end - 1;
+                mayBeUnary = false;  // A name behaves like an operand.
             } else if (c == '(' || c == ')') {  // Parentheses handling.
                 tokens.push_back(Token{std::string(1, c), TokenType::PARENTHESIS});
                 mayBeUnary = c == '(';  // After '(', the next operator can be unary.
-            } else if (!std::isspace(c)) {  // Handling invalid characters.
+            } else if (c == ',') {  // Separator between function arguments.
+                tokens.push_back(Token{",", TokenType::SEPARATOR});
+                mayBeUnary = true;  // An argument may start with a unary operator.
+            } else if (!std::isspace(static_cast<unsigned char>(c))) {  // Handling invalid characters.
                 return std::vector<Token>{{std::string(1, c), TokenType::INVALID}};
             }
         }
@@ -68,22 +386,92 @@ private:
     bool isOperator(char c) {
         return c == '+' || c == '-' || c == '*' || c == '/' || c == '%' || c == '^';
     }
+
+    // Read the number literal starting at expression[start] into token and
+    // return its length. Accepted forms: 42, 3.14, .5, 1e10, 2.5E-3, hex
+    // floats like 0x1.8p3 or 0xFF, and '_' between digits as a separator
+    // (1_000_000). The value comes from std::from_chars, which is
+    // locale-independent and correctly rounded. The token keeps the literal's
+    // text, without separators, in token.value; that is the one string built
+    // per literal, and short literals fit in its inline buffer.
+    static size_t scanNumber(const std::string& expression, size_t start, Token& token) {
+        const char* begin = expression.data() + start;
+        const char* end = expression.data() + expression.size();
+        bool hex = end - begin > 2 && begin[0] == '0' && (begin[1] == 'x' || begin[1] == 'X');
+        const char* p = hex ? begin + 2 : begin;
+
+        auto isDigit = [hex](char c) { return hex ? std::isxdigit(static_cast<unsigned char>(c)) != 0
+                                                  : std::isdigit(static_cast<unsigned char>(c)) != 0; };
+        while (p < end && (isDigit(*p) || *p == '.' || *p == '_')) ++p;
+        bool hasExponent = p < end && (hex ? (*p == 'p' || *p == 'P') : (*p == 'e' || *p == 'E'));
+        if (hasExponent) {
+            ++p;
+            if (p < end && (*p == '+' || *p == '-')) ++p;
+            while (p < end && (std::isdigit(static_cast<unsigned char>(*p)) || *p == '_')) ++p;
+        }
+        // A letter or digit right after the literal (e.g. "12abc", "0x1g") makes it malformed.
+        while (p < end && (std::isalnum(static_cast<unsigned char>(*p)) || *p == '.' || *p == '_')) ++p;
+        std::string_view literal(begin, static_cast<size_t>(p - begin));
+        auto malformed = [&]() {
+            return std::runtime_error("Error: Malformed number '" + std::string(literal) + "'");
+        };
+
+        // Drop separators, which must sit between two digits.
+        std::string& text = token.value;
+        if (literal.find('_') == std::string_view::npos) {
+            text.assign(literal);
+        } else {
+            text.reserve(literal.size());
+            for (size_t i = 0; i < literal.size(); ++i) {
+                if (literal[i] == '_') {
+                    if (i == 0 || i + 1 == literal.size() || !isDigit(literal[i - 1]) || !isDigit(literal[i + 1])) {
+                        throw malformed();
+                    }
+                    continue;
+                }
+                text += literal[i];
+            }
+        }
+
+        const char* digits = text.data() + (hex ? 2 : 0);
+        const char* digitsEnd = text.data() + text.size();
+        if (digits == digitsEnd || (hasExponent && !std::isdigit(static_cast<unsigned char>(digitsEnd[-1])))) {
+            throw malformed();
+        }
+        auto [parsedEnd, error] = std::from_chars(digits, digitsEnd, token.number,
+                                                  hex ? std::chars_format::hex : std::chars_format::general);
+        token.isInteger = text.find_first_not_of(hex ? "0123456789abcdefABCDEF" : "0123456789", hex ? 2 : 0) == std::string::npos;
+        if (error == std::errc::result_out_of_range && parsedEnd == digitsEnd) {
+            // Whole numbers beyond double stay usable in the exact modes.
+            if (!token.isInteger) {
+                throw std::runtime_error("Error: Number out of range '" + std::string(literal) + "'");
+            }
+            token.number = std::numeric_limits<double>::infinity();
+        } else if (error != std::errc() || parsedEnd != digitsEnd) {
+            throw malformed();
+        }
+        return literal.size();
+    }
 };
 
 // ImprovedParser class transforms the sequence of tokens into a format
 // suitable for evaluation (using Reverse Polish Notation).
 class ImprovedParser {
 public:
-    // Parse the tokens into a queue representing the expression in RPN.
-    std::queue<Token> parse(const std::vector<Token>& tokens) {
+    // Parse the tokens into a queue representing the expression in RPN. With a
+    // budget, every token counts as one operation.
+    std::queue<Token> parse(const std::vector<Token>& tokens, EvaluationBudget* budget = nullptr) {
         std::queue<Token> outputQueue;  // Stores the tokens in RPN.
         std::stack<Token> operatorStack;  // Helps in reordering the tokens.
-        // Defines operator precedence for parsing.
+        // Defines operator precedence for parsing. Comparisons bind loosest, so
+        // "a + 1 < b * 2" compares the two sums; "(" has the implicit 0.
         std::map<std::string, int> precedence = {
-            {"~", 4}, {"^", 3}, {"*", 2}, {"/", 2}, {"%", 2}, {"+", 1}, {"-", 1}
+            {"~", 5}, {"^", 4}, {"*", 3}, {"/", 3}, {"%", 3}, {"+", 2}, {"-", 2},
+            {"<", 1}, {">", 1}, {"<=", 1}, {">=", 1}, {"==", 1}, {"!=", 1}
         };
 
         for (const auto& token : tokens) {
+            if (budget) budget->step();
             if (token.type == TokenType::INVALID) {
                 // Return an empty queue on encountering an invalid token.
                 return std::queue<Token>();
@@ -117,6 +505,12 @@ public:
                         return std::queue<Token>();
                     }
                 }
+            } else if (token.type == TokenType::IDENTIFIER) {
+                // Names left after inlining are variables (e.g. input columns).
+                outputQueue.push(token);
+            } else {
+                // Separators must be removed by inlining before parsing.
+                return std::queue<Token>();
             }
         }
 
@@ -134,200 +528,5502 @@ public:
     }
 };
 
-// RefinedEvaluator class evaluates the expression represented in RPN.
-class RefinedEvaluator {
-public:
-    // Evaluate the parsed expression (in RPN) and return the result.
-    double evaluate(std::queue<Token> parsedExpression) {
-        std::stack<double> evaluationStack;  // Stack to hold intermediate results.
-
-        while (!parsedExpression.empty()) {
-            Token token = parsedExpression.front();
-            parsedExpression.pop();
+// Numeric backends used by RefinedEvaluator. Each backend defines the Value type
+// it computes with and how literals, operators and results are handled, so every
+// mode shares the same tokenizer, parser and evaluation loop.
 
-            if (token.type == TokenType::NUMBER) {
-                // Push numbers onto the stack.
-                evaluationStack.push(std::stod(token.value));
-            } else if (token.type == TokenType::OPERATOR) {
-                // Evaluate the operator with operands from the stack.
-                if (token.value == "~") {
-                    // Unary operator handling.
-                    if (evaluationStack.empty()) {
-                        throw std::runtime_error("Error: Insufficient operands for unary operator");
-                    }
-                    double operand = evaluationStack.top(); evaluationStack.pop();
-                    evaluationStack.push(-operand);
-                } else {
-                    // Binary operator handling.
-                    if (evaluationStack.size() < 2) {
-                        throw std::runtime_error("Error: Insufficient operands for operator '" + token.value + "'");
-                    }
-                    double right = evaluationStack.top(); evaluationStack.pop();
-                    double left = evaluationStack.top(); evaluationStack.pop();
+// Comparison operators give 1 when they hold and 0 otherwise, in every mode.
+bool isComparison(const std::string& op) {
+    return op == "<" || op == ">" || op == "<=" || op == ">=" || op == "==" || op == "!=";
+}
 
-                    if ((token.value == "/" || token.value == "%") && right == 0.0) {
-                        throw std::runtime_error("Error: Attempted division/modulo by zero");
-                    }
+// Whether comparison op holds for operands whose difference has the sign of order.
+bool comparisonHolds(const std::string& op, int order) {
+    if (op == "<") return order < 0;
+    if (op == ">") return order > 0;
+    if (op == "<=") return order <= 0;
+    if (op == ">=") return order >= 0;
+    if (op == "==") return order == 0;
+    return order != 0;
+}
 
-                    evaluationStack.push(applyOperator(left, right, token.value));
-                }
-            }
-        }
+// True if x * (1 / c) equals x / c for every x: c is a power of two whose
+// reciprocal is a normal double.
+bool hasExactReciprocal(double c) {
+    int exponent;
+    return std::fabs(std::frexp(c, &exponent)) == 0.5 && std::isnormal(1.0 / c);
+}
 
-        if (evaluationStack.size() != 1) {
-            throw std::runtime_error("Error: Invalid expression format");
-        }
+// DoubleArithmetic evaluates every number as a double (the default mode).
+struct DoubleArithmetic {
+    using Value = double;
 
-        return evaluationStack.top();  // Return the final result.
-    }
+    Value fromLiteral(const Token& token) const { return token.number; }
+    bool isZero(const Value& value) const { return value == 0.0; }
+    Value negate(const Value& value) const { return -value; }
 
-private:
-    // Apply the specified operator to the given operands.
-    double applyOperator(double left, double right, const std::string& op) {
+    Value apply(const Value& left, const Value& right, const std::string& op) const {
         if (op == "+") return left + right;
         if (op == "-") return left - right;
         if (op == "*") return left * right;
         if (op == "/") return left / right;  // Division by zero is checked earlier.
         if (op == "%") return std::fmod(left, right);  // Modulo by zero is checked earlier.
         if (op == "^") return std::pow(left, right);
-        if (op == "~") return -left;
+        // Written out so that NaN compares unequal to everything.
+        if (op == "<") return left < right;
+        if (op == ">") return left > right;
+        if (op == "<=") return left <= right;
+        if (op == ">=") return left >= right;
+        if (op == "==") return left == right;
+        if (op == "!=") return left != right;
         throw std::runtime_error("Unknown operator");
     }
+
+    std::string format(const Value& value) const {
+        std::ostringstream oss;
+        oss << value;
+        return oss.str();
+    }
 };
 
-// CalculatorHistory class maintains a history of expressions evaluated.
-class CalculatorHistory {
+// A value in integer mode: an exact 64-bit integer, or a double once a result
+// overflows or is not a whole number (e.g. 7 / 2 or a literal with a decimal point).
+struct IntegerValue {
+    bool exact;
+    int64_t integer;
+    double real;
+
+    double toDouble() const { return exact ? static_cast<double>(integer) : real; }
+};
+
+// IntegerArithmetic evaluates whole numbers with native 64-bit arithmetic and
+// checks every step for overflow, promoting the result to double when it does.
+struct IntegerArithmetic {
+    using Value = IntegerValue;
+
+    static Value exact(int64_t integer) { return Value{true, integer, 0.0}; }
+    static Value real(double value) { return Value{false, 0, value}; }
+
+    Value fromLiteral(const Token& token) const {
+        if (token.isInteger) {
+            errno = 0;
+            char* end = nullptr;
+            long long integer = std::strtoll(token.value.c_str(), &end, isHexLiteral(token.value) ? 16 : 10);
+            if (errno != ERANGE && *end == '\0') {
+                return exact(integer);
+            }
+        }
+        return real(token.number);
+    }
+
+    bool isZero(const Value& value) const {
+        return value.exact ? value.integer == 0 : value.real == 0.0;
+    }
+
+    Value negate(const Value& value) const {
+        int64_t result;
+        if (value.exact && !__builtin_sub_overflow(int64_t(0), value.integer, &result)) {
+            return exact(result);
+        }
+        return real(-value.toDouble());
+    }
+
+    Value apply(const Value& left, const Value& right, const std::string& op) const {
+        if (left.exact && right.exact) {
+            int64_t a = left.integer, b = right.integer, result;
+            if (isComparison(op)) return exact(comparisonHolds(op, (a > b) - (a < b)));
+            if (op == "+" && !__builtin_add_overflow(a, b, &result)) return exact(result);
+            if (op == "-" && !__builtin_sub_overflow(a, b, &result)) return exact(result);
+            if (op == "*" && !__builtin_mul_overflow(a, b, &result)) return exact(result);
+            // INT64_MIN / -1 is the only quotient that overflows.
+            if (op == "/" && !(a == INT64_MIN && b == -1) && a % b == 0) return exact(a / b);
+            if (op == "%") return exact(b == -1 ? 0 : a % b);
+            if (op == "^" && b >= 0) {
+                bool overflow = false;
+                int64_t power = integerPower(a, b, overflow);
+                if (!overflow) return exact(power);
+            }
+        }
+        return real(DoubleArithmetic().apply(left.toDouble(), right.toDouble(), op));
+    }
+
+    std::string format(const Value& value) const {
+        return value.exact ? std::to_string(value.integer) : DoubleArithmetic().format(value.real);
+    }
+
+private:
+    // Square-and-multiply power; sets overflow if any step leaves the int64 range.
+    static int64_t integerPower(int64_t base, int64_t exponent, bool& overflow) {
+        int64_t result = 1;
+        while (exponent > 0) {
+            if ((exponent & 1) && __builtin_mul_overflow(result, base, &result)) {
+                overflow = true;
+                return 0;
+            }
+            exponent >>= 1;
+            if (exponent > 0 && __builtin_mul_overflow(base, base, &base)) {
+                overflow = true;
+                return 0;
+            }
+        }
+        return result;
+    }
+};
+
+// ModularArithmetic reduces every result modulo a configured 64-bit modulus.
+// For odd moduli values are kept in Montgomery form, so a multiplication is a
+// 64x64->128-bit product and one reduction without any division; even moduli
+// use a plain 128-bit remainder. "^" is square-and-multiply with the true
+// whole exponent, not its residue (a^m is not a^0), which resolveExponents
+// computes before evaluation.
+class ModularArithmetic {
 public:
-    // Add an entry to the history with the expression and its result.
-    void addEntry(const std::string& expression, const std::string& result) {
-        history.emplace_back(expression, result);
+    using Value = uint64_t;  // A residue (in Montgomery form when the modulus is odd).
+
+    explicit ModularArithmetic(uint64_t modulus) : modulus(modulus), montgomery(modulus % 2 == 1) {
+        if (modulus < 2) {
+            throw std::runtime_error("Error: The modulus must be at least 2");
+        }
+        if (montgomery) {
+            // Newton iteration for modulus^-1 mod 2^64; each step doubles the correct bits.
+            inverse = modulus;
+            for (int i = 0; i < 5; ++i) {
+                inverse *= 2 - modulus * inverse;
+            }
+            uint64_t r = (0 - modulus) % modulus;  // 2^64 mod modulus.
+            rSquared = static_cast<uint64_t>(static_cast<unsigned __int128>(r) * r % modulus);
+        }
     }
 
-    // Display the history of expressions and their results.
-    void showHistory() const {
-        if (history.empty()) {
-            std::cout << "\n--------------------------------------------------------------------------------\n";
-            std::cout << "\nNo previous instances.\n";
-            return;
+    Value fromLiteral(const Token& token) const {
+        if (!token.isInteger) {
+            throw std::runtime_error("Error: Modular mode only supports whole numbers");
         }
-        std::cout << "\n--------------------------------------------------------------------------------\n";
-        std::cout << "\nHistory:\n";
-        for (const auto& entry : history) {
-            std::cout << "\nExpression: " << entry.first << " | Result: " << entry.second << "\n";
+        bool hex = isHexLiteral(token.value);
+        uint64_t residue = 0;
+        for (size_t i = hex ? 2 : 0; i < token.value.size(); ++i) {
+            residue = static_cast<uint64_t>((static_cast<unsigned __int128>(residue) * (hex ? 16 : 10) +
+                                             digitValue(token.value[i])) % modulus);
+        }
+        return toForm(residue);
+    }
+
+    bool isZero(const Value& value) const { return value == 0; }
+
+    Value negate(const Value& value) const { return value == 0 ? 0 : modulus - value; }
+
+    Value apply(const Value& left, const Value& right, const std::string& op) const {
+        if (op == "+") return left >= modulus - right ? left - (modulus - right) : left + right;
+        if (op == "-") return left >= right ? left - right : modulus - (right - left);
+        if (op == "*") return multiply(left, right);
+        if (op == "/") return multiply(left, toForm(invert(toNormal(right))));
+        if (op == "%") return toForm(toNormal(left) % toNormal(right));
+        if (op == "^") {
+            // The residue of the exponent is not enough; see resolveExponents.
+            throw std::runtime_error("Error: Modular exponent was not resolved");
+        }
+        if (op == "==" || op == "!=") return toForm((left == right) == (op == "=="));
+        if (isComparison(op)) {
+            throw std::runtime_error("Error: Residues modulo " + std::to_string(modulus) + " have no order");
+        }
+        throw std::runtime_error("Unknown operator");
+    }
+
+    std::string format(const Value& value) const {
+        return std::to_string(residue(value));
+    }
+
+    // The residue a value stands for, from 0 to modulus - 1.
+    uint64_t residue(const Value& value) const { return toNormal(value); }
+
+    // base ^ exponent, by square-and-multiply.
+    Value power(Value base, uint64_t exponent) const {
+        Value result = toForm(1);
+        while (exponent > 0) {
+            if (exponent & 1) result = multiply(result, base);
+            base = multiply(base, base);
+            exponent >>= 1;
         }
+        return result;
     }
 
 private:
-    std::list<std::pair<std::string, std::string>> history;  // List to store expression-result pairs.
+    // Montgomery reduction: t * 2^-64 mod modulus, for t < modulus * 2^64.
+    uint64_t reduce(unsigned __int128 t) const {
+        uint64_t q = static_cast<uint64_t>(t) * inverse;
+        uint64_t high = static_cast<uint64_t>(t >> 64);
+        uint64_t qm = static_cast<uint64_t>((static_cast<unsigned __int128>(q) * modulus) >> 64);
+        return high >= qm ? high - qm : high - qm + modulus;
+    }
+
+    uint64_t multiply(uint64_t a, uint64_t b) const {
+        unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+        return montgomery ? reduce(product) : static_cast<uint64_t>(product % modulus);
+    }
+
+    uint64_t toForm(uint64_t residue) const {
+        return montgomery ? reduce(static_cast<unsigned __int128>(residue) * rSquared) : residue;
+    }
+
+    uint64_t toNormal(uint64_t value) const {
+        return montgomery ? reduce(value) : value;
+    }
+
+    // Modular inverse by the extended Euclidean algorithm.
+    uint64_t invert(uint64_t value) const {
+        __int128 r0 = modulus, r1 = value, t0 = 0, t1 = 1;
+        while (r1 != 0) {
+            __int128 q = r0 / r1;
+            __int128 r2 = r0 - q * r1; r0 = r1; r1 = r2;
+            __int128 t2 = t0 - q * t1; t0 = t1; t1 = t2;
+        }
+        if (r0 != 1) {
+            throw std::runtime_error("Error: Divisor has no inverse modulo " + std::to_string(modulus));
+        }
+        return static_cast<uint64_t>(t0 < 0 ? t0 + modulus : t0);
+    }
+
+    uint64_t modulus;
+    bool montgomery;        // True when the modulus is odd.
+    uint64_t inverse = 0;   // modulus^-1 mod 2^64.
+    uint64_t rSquared = 0;  // 2^128 mod modulus, used to enter Montgomery form.
 };
 
-// Function declarations for menu options.
-void printMenu();
-void handleExpression(CalculatorHistory& history, EnhancedTokenizer& tokenizer, ImprovedParser& parser, RefinedEvaluator& evaluator);
-void showHistory(const CalculatorHistory& history);
-void showUserManual();
+// BigInteger is an arbitrary-precision signed integer stored as base-2^32 limbs,
+// least significant first, with no leading zero limbs (zero has no limbs).
+// Multiplication switches from schoolbook to Karatsuba above
+// karatsubaThreshold limbs; decimal conversion splits the number recursively
+// by powers of 10^9 so both directions stay close to the cost of a multiply.
+class BigInteger {
+public:
+    static size_t karatsubaThreshold;  // Limb count at which Karatsuba takes over.
 
-// Function to display the main menu.
-void printMenu() {
-    std::cout << "\n--------------------------------------------------------------------------------\n";
-    std::cout << "C++ Arithmetic Expression Evaluator\n";
-    std::cout << "--------------------------------------------------------------------------------\n\n";
-    std::cout << "1 - Enter Expression\n";
-    std::cout << "2 - History\n";
-    std::cout << "3 - User Manual\n";
-    std::cout << "4 - Quit\n";
-    std::cout << "\n--------------------------------------------------------------------------------\n";
-    std::cout << "\nSelect an option: ";
-}
+    BigInteger() = default;
 
-// Function to handle the "Enter Expression" option.
-void handleExpression(CalculatorHistory& history, EnhancedTokenizer& tokenizer, ImprovedParser& parser, RefinedEvaluator& evaluator) {
-    std::string expression;
-    std::cout << "\n--------------------------------------------------------------------------------\n";
-    std::cout << "\nEnter an arithmetic expression: ";
-    std::getline(std::cin, expression);
+    BigInteger(int64_t value) : negative(value < 0) {
+        uint64_t magnitude = value < 0 ? 0 - static_cast<uint64_t>(value) : static_cast<uint64_t>(value);
+        while (magnitude > 0) {
+            limbs.push_back(static_cast<uint32_t>(magnitude));
+            magnitude >>= 32;
+        }
+    }
 
-    auto tokens = tokenizer.tokenize(expression);
-    std::string result;
+    // Parse an unsigned decimal string of digits.
+    static BigInteger fromDecimal(const std::string& digits) {
+        std::vector<BigInteger> powers;
+        BigInteger result;
+        result.limbs = fromDecimal(digits, 0, digits.size(), powers);
+        return result;
+    }
 
-    // Handling errors in tokenization, parsing, and evaluation
-    if (tokens.empty() || (tokens.size() == 1 && tokens.front().type == TokenType::INVALID)) {
-        result = "Error, Invalid expression";
-    } else {
-        auto parsedExpression = parser.parse(tokens);
-        if (parsedExpression.empty()) {
-            result = "Error, Invalid expression";
-        } else {
-            try {
-                double evalResult = evaluator.evaluate(parsedExpression);
-                std::ostringstream oss;
-                oss << evalResult;
-                result = oss.str();
-            } catch (const std::runtime_error& e) {
-                result = e.what();
-            }
+    // Parse hex digits without the "0x"; each is four bits, so no arithmetic.
+    static BigInteger fromHex(std::string_view digits) {
+        BigInteger result;
+        result.limbs.assign((digits.size() + 7) / 8, 0);
+        for (size_t i = 0; i < digits.size(); ++i) {
+            size_t bit = 4 * (digits.size() - 1 - i);
+            result.limbs[bit / 32] |= static_cast<uint32_t>(digitValue(digits[i])) << (bit % 32);
         }
+        trim(result.limbs);
+        return result;
     }
 
-    std::cout << "\nResult: " << result << "\n";
-    history.addEntry(expression, result);  // Add expression and result to history
-}
+    std::string toDecimal() const {
+        if (limbs.empty()) return "0";
+        std::vector<BigInteger> powers;
+        std::string digits = toDecimal(limbs, 0, powers);
+        digits.erase(0, std::min(digits.find_first_not_of('0'), digits.size() - 1));
+        return negative ? "-" + digits : digits;
+    }
 
-// Function to display the history of calculations.
-void showHistory(const CalculatorHistory& history) {
-    history.showHistory();
-}
+    bool isZero() const { return limbs.empty(); }
+    bool isNegative() const { return negative; }
+    bool isOdd() const { return !limbs.empty() && (limbs[0] & 1); }
+    size_t bitLength() const { return limbs.empty() ? 0 : 32 * limbs.size() - __builtin_clz(limbs.back()); }
 
-// Function to display the user manual.
-void showUserManual() {
-    std::cout << "\nUser Manual:\n";
-    std::cout << "--------------------------------------------------------------------------------\n";
-    std::cout << "\nWelcome to the C++ Arithmetic Expression Evaluator.\n";
-    std::cout << "This program allows you to evaluate arithmetic expressions involving\n";
-    std::cout << "basic operators such as +, -, *, /, %, and ^ (exponentiation).\n\n";
-    
-    std::cout << "Menu Options:\n";
-    std::cout << "1 - Enter Expression: Allows you to input an arithmetic expression.\n";
-    std::cout << "2 - History: Displays the history of evaluated expressions and their results.\n";
-    std::cout << "3 - User Manual: Shows this user manual.\n";
-    std::cout << "4 - Quit: Exits the program.\n\n";
+    // Return true and store the value if it fits in 64 bits.
+    bool toInt64(int64_t& value) const {
+        if (limbs.size() > 2) return false;
+        uint64_t magnitude = 0;
+        for (size_t i = limbs.size(); i-- > 0;) magnitude = (magnitude << 32) | limbs[i];
+        if (magnitude > (negative ? uint64_t(1) << 63 : uint64_t(INT64_MAX))) return false;
+        value = negative ? static_cast<int64_t>(0 - magnitude) : static_cast<int64_t>(magnitude);
+        return true;
+    }
 
-    std::cout << "Entering Expressions:\n";
-    std::cout << "Enter any arithmetic expression using numbers and operators.\n";
-    std::cout << "For example: '3 + 4 * 2', '2 ^ 3', '(4 + 5) / 2'.\n";
-    std::cout << "The program supports parentheses for grouping.\n\n";
+    // The value as mantissa * 2^exponent, with the mantissa made of the top 64
+    // bits, so quotients of values beyond the range of double stay finite.
+    double mantissa(int64_t& exponent) const {
+        size_t bits = bitLength();
+        size_t shift = bits > 64 ? bits - 64 : 0;
+        uint64_t top = 0;
+        for (size_t bit = bits; bit-- > shift;) {
+            top = (top << 1) | ((limbs[bit / 32] >> (bit % 32)) & 1);
+        }
+        exponent = static_cast<int64_t>(shift);
+        return negative ? -static_cast<double>(top) : static_cast<double>(top);
+    }
 
-    std::cout << "History:\n";
-    std::cout << "After evaluating expressions, you can view their history\n";
-    std::cout << "along with the results by selecting the 'History' option.\n";
-    std::cout << "\n--------------------------------------------------------------------------------\n";
-}
+    double toDouble() const {
+        int64_t exponent;
+        double value = mantissa(exponent);
+        return std::ldexp(value, static_cast<int>(std::min<int64_t>(exponent, 1 << 20)));
+    }
 
-// Main program function.
-int main() {
-    EnhancedTokenizer tokenizer;    
-    ImprovedParser parser;
-    RefinedEvaluator evaluator;
-    CalculatorHistory history;
+    BigInteger operator-() const {
+        BigInteger result = *this;
+        result.negative = !result.limbs.empty() && !negative;
+        return result;
+    }
 
-    int option = 0;
-    do {
-        printMenu();  // Display the main menu
-        std::cin >> option;
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n'); 
+    friend BigInteger operator+(const BigInteger& a, const BigInteger& b) {
+        if (a.negative == b.negative) return make(a.negative, addMagnitude(a.limbs, b.limbs));
+        if (compareMagnitude(a.limbs, b.limbs) >= 0) return make(a.negative, subtractMagnitude(a.limbs, b.limbs));
+        return make(b.negative, subtractMagnitude(b.limbs, a.limbs));
+    }
 
-        // Handling user menu selection
-        switch (option) {
-            case 1:
-                handleExpression(history, tokenizer, parser, evaluator);  // Enter and evaluate an expression
-                break;
-            case 2:
-                showHistory(history);  // Display history of expressions and results
-                break;
+    friend BigInteger operator-(const BigInteger& a, const BigInteger& b) { return a + -b; }
+
+    friend BigInteger operator*(const BigInteger& a, const BigInteger& b) {
+        return make(a.negative != b.negative,
+                    multiplyMagnitude(a.limbs.data(), a.limbs.size(), b.limbs.data(), b.limbs.size()));
+    }
+
+    // Truncating division: the quotient rounds toward zero and the remainder
+    // takes the sign of the dividend. The divisor must be nonzero.
+    static void divide(const BigInteger& a, const BigInteger& b, BigInteger& quotient, BigInteger& remainder) {
+        Limbs q, r;
+        divideMagnitude(a.limbs, b.limbs, q, r);
+        quotient = make(a.negative != b.negative, std::move(q));
+        remainder = make(a.negative, std::move(r));
+    }
+
+    // Square-and-multiply power.
+    BigInteger pow(uint64_t exponent) const {
+        BigInteger result(1), base = *this;
+        while (exponent > 0) {
+            if (exponent & 1) result = result * base;
+            exponent >>= 1;
+            if (exponent > 0) base = base * base;
+        }
+        return result;
+    }
+
+private:
+    using Limbs = std::vector<uint32_t>;
+
+    static BigInteger make(bool negative, Limbs limbs) {
+        trim(limbs);
+        BigInteger result;
+        result.negative = negative && !limbs.empty();
+        result.limbs = std::move(limbs);
+        return result;
+    }
+
+    static void trim(Limbs& limbs) {
+        while (!limbs.empty() && limbs.back() == 0) limbs.pop_back();
+    }
+
+    static int compareMagnitude(const Limbs& a, const Limbs& b) {
+        if (a.size() != b.size()) return a.size() < b.size() ? -1 : 1;
+        for (size_t i = a.size(); i-- > 0;) {
+            if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+        }
+        return 0;
+    }
+
+    static Limbs addMagnitude(const Limbs& a, const Limbs& b) {
+        const Limbs& longer = a.size() >= b.size() ? a : b;
+        const Limbs& shorter = a.size() >= b.size() ? b : a;
+        Limbs result(longer.size() + 1);
+        uint64_t carry = 0;
+        for (size_t i = 0; i < longer.size(); ++i) {
+            carry += static_cast<uint64_t>(longer[i]) + (i < shorter.size() ? shorter[i] : 0);
+            result[i] = static_cast<uint32_t>(carry);
+            carry >>= 32;
+        }
+        result[longer.size()] = static_cast<uint32_t>(carry);
+        trim(result);
+        return result;
+    }
+
+    // a - b for |a| >= |b|.
+    static Limbs subtractMagnitude(const Limbs& a, const Limbs& b) {
+        Limbs result(a.size());
+        int64_t borrow = 0;
+        for (size_t i = 0; i < a.size(); ++i) {
+            int64_t difference = static_cast<int64_t>(a[i]) - (i < b.size() ? b[i] : 0) - borrow;
+            borrow = difference < 0;
+            result[i] = static_cast<uint32_t>(difference + (borrow << 32));
+        }
+        trim(result);
+        return result;
+    }
+
+    // Add x * 2^(32 * shift) into accumulator, which must be large enough.
+    static void addShifted(Limbs& accumulator, const Limbs& x, size_t shift) {
+        uint64_t carry = 0;
+        size_t i = 0;
+        for (; i < x.size(); ++i) {
+            carry += static_cast<uint64_t>(accumulator[i + shift]) + x[i];
+            accumulator[i + shift] = static_cast<uint32_t>(carry);
+            carry >>= 32;
+        }
+        for (i += shift; carry != 0; ++i) {
+            carry += accumulator[i];
+            accumulator[i] = static_cast<uint32_t>(carry);
+            carry >>= 32;
+        }
+    }
+
+    static Limbs slice(const uint32_t* data, size_t size) {
+        Limbs result(data, data + size);
+        trim(result);
+        return result;
+    }
+
+    static Limbs multiplySchoolbook(const uint32_t* a, size_t n, const uint32_t* b, size_t m) {
+        Limbs result(n + m);
+        for (size_t i = 0; i < n; ++i) {
+            uint64_t carry = 0;
+            for (size_t j = 0; j < m; ++j) {
+                carry += static_cast<uint64_t>(a[i]) * b[j] + result[i + j];
+                result[i + j] = static_cast<uint32_t>(carry);
+                carry >>= 32;
+            }
+            result[i + m] = static_cast<uint32_t>(carry);
+        }
+        trim(result);
+        return result;
+    }
+
+    static Limbs multiplyMagnitude(const uint32_t* a, size_t n, const uint32_t* b, size_t m) {
+        if (n < m) {
+            std::swap(a, b);
+            std::swap(n, m);
+        }
+        if (m == 0) return Limbs();
+        if (m < karatsubaThreshold) return multiplySchoolbook(a, n, b, m);
+
+        size_t k = (n + 1) / 2;
+        Limbs result(n + m + 1);
+        if (m <= k) {
+            // Unbalanced operands: multiply b by each half of a separately.
+            addShifted(result, multiplyMagnitude(a, k, b, m), 0);
+            addShifted(result, multiplyMagnitude(a + k, n - k, b, m), k);
+            trim(result);
+            return result;
+        }
+
+        // Karatsuba: (a1 B + a0)(b1 B + b0) = z2 B^2 + ((a0 + a1)(b0 + b1) - z0 - z2) B + z0.
+        Limbs a0 = slice(a, k), a1 = slice(a + k, n - k);
+        Limbs b0 = slice(b, k), b1 = slice(b + k, m - k);
+        Limbs z0 = multiplyMagnitude(a0.data(), a0.size(), b0.data(), b0.size());
+        Limbs z2 = multiplyMagnitude(a1.data(), a1.size(), b1.data(), b1.size());
+        Limbs sumA = addMagnitude(a0, a1), sumB = addMagnitude(b0, b1);
+        Limbs z1 = multiplyMagnitude(sumA.data(), sumA.size(), sumB.data(), sumB.size());
+        z1 = subtractMagnitude(subtractMagnitude(z1, z0), z2);
+
+        addShifted(result, z0, 0);
+        addShifted(result, z1, k);
+        addShifted(result, z2, 2 * k);
+        trim(result);
+        return result;
+    }
+
+    // Long division (Knuth, Algorithm D) on magnitudes; v must be nonzero.
+    static void divideMagnitude(const Limbs& u, const Limbs& v, Limbs& quotient, Limbs& remainder) {
+        if (compareMagnitude(u, v) < 0) {
+            quotient.clear();
+            remainder = u;
+            return;
+        }
+        size_t n = v.size(), m = u.size() - v.size();
+        quotient.assign(m + 1, 0);
+
+        if (n == 1) {
+            uint64_t rest = 0;
+            for (size_t i = u.size(); i-- > 0;) {
+                rest = (rest << 32) | u[i];
+                quotient[i] = static_cast<uint32_t>(rest / v[0]);
+                rest %= v[0];
+            }
+            trim(quotient);
+            remainder = rest ? Limbs{static_cast<uint32_t>(rest)} : Limbs();
+            return;
+        }
+
+        // Normalize so the top limb of the divisor has its high bit set.
+        int shift = __builtin_clz(v.back());
+        Limbs vn(n), un(u.size() + 1);
+        for (size_t i = n; i-- > 0;) {
+            vn[i] = (v[i] << shift) | (shift && i > 0 ? v[i - 1] >> (32 - shift) : 0);
+        }
+        un[u.size()] = shift ? u.back() >> (32 - shift) : 0;
+        for (size_t i = u.size(); i-- > 0;) {
+            un[i] = (u[i] << shift) | (shift && i > 0 ? u[i - 1] >> (32 - shift) : 0);
+        }
+
+        const uint64_t base = uint64_t(1) << 32;
+        for (size_t j = m + 1; j-- > 0;) {
+            uint64_t numerator = (static_cast<uint64_t>(un[j + n]) << 32) | un[j + n - 1];
+            uint64_t qhat = numerator / vn[n - 1];
+            uint64_t rhat = numerator % vn[n - 1];
+            while (qhat >= base || qhat * vn[n - 2] > ((rhat << 32) | un[j + n - 2])) {
+                --qhat;
+                rhat += vn[n - 1];
+                if (rhat >= base) break;
+            }
+
+            // Multiply and subtract qhat * vn from the current window of un.
+            int64_t borrow = 0, t;
+            for (size_t i = 0; i < n; ++i) {
+                uint64_t product = qhat * vn[i];
+                t = static_cast<int64_t>(un[i + j]) - borrow - static_cast<int64_t>(product & 0xFFFFFFFF);
+                un[i + j] = static_cast<uint32_t>(t);
+                borrow = static_cast<int64_t>(product >> 32) - (t >> 32);
+            }
+            t = static_cast<int64_t>(un[j + n]) - borrow;
+            un[j + n] = static_cast<uint32_t>(t);
+
+            quotient[j] = static_cast<uint32_t>(qhat);
+            if (t < 0) {
+                // qhat was one too large: add the divisor back.
+                --quotient[j];
+                uint64_t carry = 0;
+                for (size_t i = 0; i < n; ++i) {
+                    carry += static_cast<uint64_t>(un[i + j]) + vn[i];
+                    un[i + j] = static_cast<uint32_t>(carry);
+                    carry >>= 32;
+                }
+                un[j + n] += static_cast<uint32_t>(carry);
+            }
+        }
+
+        remainder.assign(n, 0);
+        for (size_t i = 0; i < n; ++i) {
+            remainder[i] = (un[i] >> shift) | (shift ? un[i + 1] << (32 - shift) : 0);
+        }
+        trim(quotient);
+        trim(remainder);
+    }
+
+    // powers[i] holds 10^(9 * 2^i), computed on first use.
+    static const BigInteger& powerOfTen(std::vector<BigInteger>& powers, size_t i) {
+        while (powers.size() <= i) {
+            powers.push_back(powers.empty() ? BigInteger(1000000000) : powers.back() * powers.back());
+        }
+        return powers[i];
+    }
+
+    static constexpr size_t smallDecimalLimbs = 32;  // Below this, convert 9 digits at a time.
+
+    // Convert digits[begin, end) by splitting off the low 9 * 2^i digits.
+    static Limbs fromDecimal(const std::string& digits, size_t begin, size_t end, std::vector<BigInteger>& powers) {
+        size_t length = end - begin;
+        if (length <= 9 * smallDecimalLimbs) {
+            Limbs result;
+            for (size_t i = begin; i < end;) {
+                size_t chunk = std::min<size_t>(9, end - i);
+                uint64_t carry = std::stoul(digits.substr(i, chunk));
+                uint64_t scale = 1;
+                for (size_t c = 0; c < chunk; ++c) scale *= 10;
+                for (auto& limb : result) {
+                    carry += static_cast<uint64_t>(limb) * scale;
+                    limb = static_cast<uint32_t>(carry);
+                    carry >>= 32;
+                }
+                if (carry) result.push_back(static_cast<uint32_t>(carry));
+                i += chunk;
+            }
+            trim(result);
+            return result;
+        }
+        size_t level = 0;
+        while (9 * (size_t(2) << level) < length) ++level;
+        size_t lowDigits = 9 * (size_t(1) << level);
+        const BigInteger& scale = powerOfTen(powers, level);
+        Limbs high = fromDecimal(digits, begin, end - lowDigits, powers);
+        Limbs low = fromDecimal(digits, end - lowDigits, end, powers);
+        Limbs result = multiplyMagnitude(high.data(), high.size(), scale.limbs.data(), scale.limbs.size());
+        result.resize(std::max(result.size(), low.size()) + 1);
+        addShifted(result, low, 0);
+        trim(result);
+        return result;
+    }
+
+    // Convert a magnitude to decimal, left-padded with zeros to width digits.
+    static std::string toDecimal(const Limbs& value, size_t width, std::vector<BigInteger>& powers) {
+        std::string digits;
+        if (value.size() <= smallDecimalLimbs) {
+            Limbs rest = value;
+            while (!rest.empty()) {
+                uint64_t remainder = 0;
+                for (size_t i = rest.size(); i-- > 0;) {
+                    remainder = (remainder << 32) | rest[i];
+                    rest[i] = static_cast<uint32_t>(remainder / 1000000000);
+                    remainder %= 1000000000;
+                }
+                trim(rest);
+                std::string chunk = std::to_string(remainder);
+                digits.insert(0, rest.empty() ? chunk : std::string(9 - chunk.size(), '0') + chunk);
+            }
+        } else {
+            // Split at the largest 10^(9 * 2^i) not exceeding about half the number.
+            size_t level = 0;
+            while (powerOfTen(powers, level + 1).limbs.size() * 2 <= value.size() + 1) ++level;
+            const BigInteger& scale = powerOfTen(powers, level);
+            Limbs high, low;
+            divideMagnitude(value, scale.limbs, high, low);
+            size_t lowDigits = 9 * (size_t(1) << level);
+            digits = toDecimal(high, 0, powers) + toDecimal(low, lowDigits, powers);
+        }
+        if (digits.size() < width) digits.insert(0, width - digits.size(), '0');
+        return digits;
+    }
+
+    bool negative = false;
+    Limbs limbs;
+};
+
+size_t BigInteger::karatsubaThreshold = 40;
+
+// BigIntegerArithmetic evaluates whole numbers of any size, so "2^4096" is exact.
+// "/" truncates toward zero and "%" takes the sign of the dividend.
+struct BigIntegerArithmetic {
+    using Value = BigInteger;
+
+    static constexpr size_t maxResultBits = size_t(1) << 26;  // About 20 million digits.
+
+    Value fromLiteral(const Token& token) const {
+        if (!token.isInteger) {
+            throw std::runtime_error("Error: Big integer mode only supports whole numbers");
+        }
+        if (isHexLiteral(token.value)) return BigInteger::fromHex(std::string_view(token.value).substr(2));
+        return BigInteger::fromDecimal(token.value);
+    }
+
+    bool isZero(const Value& value) const { return value.isZero(); }
+    Value negate(const Value& value) const { return -value; }
+
+    Value apply(const Value& left, const Value& right, const std::string& op) const {
+        if (op == "+") return left + right;
+        if (op == "-") return left - right;
+        if (op == "*") return left * right;
+        if (op == "/" || op == "%") {
+            BigInteger quotient, remainder;
+            BigInteger::divide(left, right, quotient, remainder);
+            return op == "/" ? quotient : remainder;
+        }
+        if (op == "^") return power(left, right);
+        if (isComparison(op)) {
+            BigInteger difference = left - right;
+            return BigInteger(comparisonHolds(op, difference.isZero() ? 0 : difference.isNegative() ? -1 : 1));
+        }
+        throw std::runtime_error("Unknown operator");
+    }
+
+    std::string format(const Value& value) const { return value.toDecimal(); }
+
+private:
+    static Value power(const Value& base, const Value& exponent) {
+        if (exponent.isNegative()) {
+            throw std::runtime_error("Error: Big integer mode does not support negative exponents");
+        }
+        if (exponent.isZero()) return BigInteger(1);
+        if (base.isZero() || base.bitLength() == 1) {
+            // 0, 1 and -1 stay small for any exponent.
+            return base.isNegative() && !exponent.isOdd() ? BigInteger(1) : base;
+        }
+        int64_t e;
+        if (!exponent.toInt64(e) || static_cast<double>(base.bitLength() - 1) * e > maxResultBits) {
+            throw std::runtime_error("Error: Result is too large");
+        }
+        return base.pow(static_cast<uint64_t>(e));
+    }
+};
+
+// A value in rational mode: an exact fraction numerator / denominator in lowest
+// terms with a positive denominator, or a double for a result that is not
+// rational (2 ^ 0.5) or comes from a hex float. A fraction that outgrows 64
+// bits moves to bigNumerator / bigDenominator, with big set, and back once it
+// fits again.
+struct RationalValue {
+    bool exact;
+    int64_t numerator;
+    int64_t denominator;
+    double real;
+    bool big = false;
+    BigInteger bigNumerator;
+    BigInteger bigDenominator;
+
+    RationalValue(bool exact = true, int64_t numerator = 0, int64_t denominator = 1, double real = 0.0)
+        : exact(exact), numerator(numerator), denominator(denominator), real(real) {}
+
+    double toDouble() const {
+        if (!exact) return real;
+        if (big) {
+            int64_t numeratorExponent, denominatorExponent;
+            double numeratorMantissa = bigNumerator.mantissa(numeratorExponent);
+            double denominatorMantissa = bigDenominator.mantissa(denominatorExponent);
+            return std::ldexp(numeratorMantissa / denominatorMantissa,
+                              static_cast<int>(std::max<int64_t>(std::min<int64_t>(numeratorExponent - denominatorExponent, 1 << 20), -(1 << 20))));
+        }
+        return static_cast<double>(numerator) / static_cast<double>(denominator);
+    }
+};
+
+// RationalArithmetic evaluates exact fractions, so "1/3 + 1/6" gives "1/2".
+// Fractions are normalized with a binary GCD, operands are cross-reduced before
+// multiplying to delay overflow, and integers and equal denominators take
+// shortcuts that skip the GCD entirely. A step that overflows 64 bits is
+// redone with BigInteger numerator and denominator, up to maxBigBits each.
+struct RationalArithmetic {
+    using Value = RationalValue;
+
+    // Big fractions are reduced with Euclid's algorithm, whose cost grows
+    // quickly with size, so the limit is far below big integer mode's.
+    static constexpr size_t maxBigBits = size_t(1) << 16;
+
+    static Value real(double value) { return Value{false, 0, 1, value}; }
+
+    Value fromLiteral(const Token& token) const {
+        // Read "123.45" as 12345 / 100 and "1.5e-3" as 15 / 10000, so decimal
+        // literals stay exact, and hex integers as whole numbers; hex floats
+        // use their double value.
+        if (isHexLiteral(token.value)) {
+            if (!token.isInteger) return real(token.number);
+            if (token.value.size() - 2 > maxBigBits / 4) throw std::runtime_error("Error: Result is too large");
+            return normalize(BigInteger::fromHex(std::string_view(token.value).substr(2)), BigInteger(1));
+        }
+        int64_t numerator = 0, denominator = 1;
+        int64_t exponent = 0;
+        bool fraction = false, overflow = false;
+        size_t i = 0;
+        for (; i < token.value.size() && token.value[i] != 'e' && token.value[i] != 'E'; ++i) {
+            char c = token.value[i];
+            if (c == '.') {
+                fraction = true;
+                continue;
+            }
+            overflow |= __builtin_mul_overflow(numerator, int64_t(10), &numerator) ||
+                        __builtin_add_overflow(numerator, int64_t(c - '0'), &numerator);
+            if (fraction) {
+                overflow |= __builtin_mul_overflow(denominator, int64_t(10), &denominator);
+            }
+        }
+        if (i < token.value.size()) {
+            exponent = std::strtoll(token.value.c_str() + i + 1, nullptr, 10);
+        }
+        int64_t scale = exponent;  // Kept for the big path.
+        for (; exponent > 0 && !overflow; --exponent) {
+            overflow = __builtin_mul_overflow(numerator, int64_t(10), &numerator);
+        }
+        for (; exponent < 0 && !overflow; ++exponent) {
+            overflow = __builtin_mul_overflow(denominator, int64_t(10), &denominator);
+        }
+        if (!overflow) return make(numerator, denominator);
+
+        // Too long for 64 bits: the digits over 10 ^ (fraction digits - exponent).
+        std::string digits;
+        int64_t fractionDigits = 0;
+        fraction = false;
+        for (size_t k = 0; k < i; ++k) {
+            if (token.value[k] == '.') {
+                fraction = true;
+            } else {
+                digits += token.value[k];
+                fractionDigits += fraction;
+            }
+        }
+        int64_t power = fractionDigits - scale;
+        if (std::fabs(static_cast<double>(power)) * 3.33 + digits.size() * 3.33 > maxBigBits) {
+            throw std::runtime_error("Error: Result is too large");
+        }
+        BigInteger tens = BigInteger(10).pow(static_cast<uint64_t>(power < 0 ? -power : power));
+        BigInteger whole = BigInteger::fromDecimal(digits);
+        return power < 0 ? normalize(whole * tens, BigInteger(1)) : normalize(whole, tens);
+    }
+
+    bool isZero(const Value& value) const {
+        if (value.big) return value.bigNumerator.isZero();
+        return value.exact ? value.numerator == 0 : value.real == 0.0;
+    }
+
+    Value negate(const Value& value) const {
+        if (value.big) return normalize(-value.bigNumerator, value.bigDenominator);
+        int64_t numerator;
+        if (value.exact && !__builtin_sub_overflow(int64_t(0), value.numerator, &numerator)) {
+            return Value{true, numerator, value.denominator, 0.0};
+        }
+        if (value.exact) return normalize(-BigInteger(value.numerator), BigInteger(value.denominator));
+        return real(-value.toDouble());
+    }
+
+    Value apply(const Value& left, const Value& right, const std::string& op) const {
+        if (left.exact && right.exact && !left.big && !right.big) {
+            if (isComparison(op)) {
+                // Denominators are positive, so cross products order the fractions.
+                __int128 p = static_cast<__int128>(left.numerator) * right.denominator;
+                __int128 q = static_cast<__int128>(right.numerator) * left.denominator;
+                return Value{true, comparisonHolds(op, (p > q) - (p < q)), 1, 0.0};
+            }
+            bool overflow = false;
+            Value result = applyExact(left, right, op, overflow);
+            if (!overflow) return result;
+        }
+        bool wholeExponent = right.big ? right.bigDenominator.bitLength() == 1 : right.denominator == 1;
+        if (left.exact && right.exact && (op != "^" || wholeExponent)) {
+            return applyBig(left, right, op);
+        }
+        return real(DoubleArithmetic().apply(left.toDouble(), right.toDouble(), op));
+    }
+
+    std::string format(const Value& value) const {
+        if (value.big) {
+            std::string numerator = value.bigNumerator.toDecimal();
+            return value.bigDenominator.bitLength() == 1 ? numerator : numerator + "/" + value.bigDenominator.toDecimal();
+        }
+        if (!value.exact) return DoubleArithmetic().format(value.real);
+        if (value.denominator == 1) return std::to_string(value.numerator);
+        return std::to_string(value.numerator) + "/" + std::to_string(value.denominator);
+    }
+
+private:
+    // Binary (Stein's) GCD on magnitudes.
+    static uint64_t gcd(uint64_t a, uint64_t b) {
+        if (a == 0) return b;
+        if (b == 0) return a;
+        int shift = __builtin_ctzll(a | b);
+        a >>= __builtin_ctzll(a);
+        do {
+            b >>= __builtin_ctzll(b);
+            if (a > b) std::swap(a, b);
+            b -= a;
+        } while (b != 0);
+        return a << shift;
+    }
+
+    static uint64_t magnitude(int64_t value) {
+        return value < 0 ? 0 - static_cast<uint64_t>(value) : static_cast<uint64_t>(value);
+    }
+
+    static int64_t gcd(int64_t a, int64_t b) {
+        // One argument is always a positive denominator, so the result fits in int64.
+        return static_cast<int64_t>(gcd(magnitude(a), magnitude(b)));
+    }
+
+    static BigInteger gcd(BigInteger a, BigInteger b) {
+        while (!b.isZero()) {
+            BigInteger quotient, remainder;
+            BigInteger::divide(a, b, quotient, remainder);
+            a = std::move(b);
+            b = std::move(remainder);
+        }
+        return a.isNegative() ? -a : a;
+    }
+
+    // Build a normalized fraction from big parts, back in 64 bits if it fits;
+    // the denominator must be nonzero.
+    static Value normalize(BigInteger numerator, BigInteger denominator) {
+        if (denominator.isNegative()) {
+            numerator = -numerator;
+            denominator = -denominator;
+        }
+        BigInteger divisor = gcd(numerator, denominator);
+        if (divisor.bitLength() > 1) {
+            BigInteger remainder;
+            BigInteger::divide(numerator, divisor, numerator, remainder);
+            BigInteger::divide(denominator, divisor, denominator, remainder);
+        }
+        Value result{true, 0, 1, 0.0};
+        if (numerator.toInt64(result.numerator) && denominator.toInt64(result.denominator)) {
+            return result;
+        }
+        if (numerator.bitLength() > maxBigBits || denominator.bitLength() > maxBigBits) {
+            throw std::runtime_error("Error: Result is too large");
+        }
+        result.big = true;
+        result.bigNumerator = std::move(numerator);
+        result.bigDenominator = std::move(denominator);
+        return result;
+    }
+
+    static void parts(const Value& value, BigInteger& numerator, BigInteger& denominator) {
+        numerator = value.big ? value.bigNumerator : BigInteger(value.numerator);
+        denominator = value.big ? value.bigDenominator : BigInteger(value.denominator);
+    }
+
+    // The exact operations again, on big parts: x = a / b and y = c / d.
+    static Value applyBig(const Value& x, const Value& y, const std::string& op) {
+        BigInteger a, b, c, d;
+        parts(x, a, b);
+        parts(y, c, d);
+        if (op == "+") return normalize(a * d + c * b, b * d);
+        if (op == "-") return normalize(a * d - c * b, b * d);
+        if (op == "*") return normalize(a * c, b * d);
+        if (op == "/") return normalize(a * d, b * c);
+        if (op == "%") {
+            // x - y * trunc(x / y), like std::fmod.
+            BigInteger quotient, remainder;
+            BigInteger::divide(a * d, b * c, quotient, remainder);
+            return normalize(a * d - quotient * c * b, b * d);
+        }
+        if (op == "^") {
+            int64_t exponent;
+            if (!c.toInt64(exponent)) throw std::runtime_error("Error: Result is too large");
+            if (exponent < 0 && a.isZero()) throw std::runtime_error("Error: Attempted division/modulo by zero");
+            uint64_t magnitude = exponent < 0 ? 0 - static_cast<uint64_t>(exponent) : static_cast<uint64_t>(exponent);
+            if (a.bitLength() > 1 && static_cast<double>(a.bitLength() - 1) * magnitude > maxBigBits) {
+                throw std::runtime_error("Error: Result is too large");
+            }
+            if (b.bitLength() > 1 && static_cast<double>(b.bitLength() - 1) * magnitude > maxBigBits) {
+                throw std::runtime_error("Error: Result is too large");
+            }
+            BigInteger n = a.pow(magnitude), m = b.pow(magnitude);
+            return exponent < 0 ? normalize(m, n) : normalize(n, m);
+        }
+        if (isComparison(op)) {
+            BigInteger difference = a * d - c * b;
+            return Value{true, comparisonHolds(op, difference.isZero() ? 0 : difference.isNegative() ? -1 : 1), 1, 0.0};
+        }
+        throw std::runtime_error("Unknown operator");
+    }
+
+    // Build a normalized fraction; the denominator must be nonzero.
+    static Value make(int64_t numerator, int64_t denominator, bool* overflow = nullptr) {
+        bool failed = false;
+        if (denominator < 0) {
+            failed = __builtin_sub_overflow(int64_t(0), numerator, &numerator) ||
+                     __builtin_sub_overflow(int64_t(0), denominator, &denominator);
+        }
+        if (!failed && denominator != 1) {
+            uint64_t divisor = gcd(magnitude(numerator), magnitude(denominator));
+            if (divisor > 1) {
+                numerator /= static_cast<int64_t>(divisor);
+                denominator /= static_cast<int64_t>(divisor);
+            }
+        }
+        if (failed) {
+            if (overflow) *overflow = true;
+            return real(0.0);
+        }
+        return Value{true, numerator, denominator, 0.0};
+    }
+
+    static Value applyExact(const Value& x, const Value& y, const std::string& op, bool& overflow) {
+        int64_t a = x.numerator, b = x.denominator, c = y.numerator, d = y.denominator;
+        int64_t n, m;
+
+        if (op == "+" || op == "-") {
+            if (op == "-" && __builtin_sub_overflow(int64_t(0), c, &c)) {
+                overflow = true;
+                return x;
+            }
+            if (b == d) {
+                // Same denominator (including plain integers): no cross products needed.
+                overflow = __builtin_add_overflow(a, c, &n);
+                return b == 1 || overflow ? Value{true, n, 1, 0.0} : make(n, b, &overflow);
+            }
+            int64_t g = gcd(b, d);
+            int64_t p, q;
+            overflow = __builtin_mul_overflow(a, d / g, &p) || __builtin_mul_overflow(c, b / g, &q) ||
+                       __builtin_add_overflow(p, q, &n) || __builtin_mul_overflow(b, d / g, &m);
+            return overflow ? x : make(n, m, &overflow);
+        }
+        if (op == "*" || op == "/") {
+            if (op == "/") {
+                // Multiply by the reciprocal; the evaluator has already ruled out zero.
+                std::swap(c, d);
+                if (d < 0 && (__builtin_sub_overflow(int64_t(0), c, &c) ||
+                              __builtin_sub_overflow(int64_t(0), d, &d))) {
+                    overflow = true;
+                    return x;
+                }
+            }
+            // Cross-reduce so the products stay as small as possible.
+            int64_t g1 = gcd(a, d), g2 = gcd(c, b);
+            if (g1 > 1) { a /= g1; d /= g1; }
+            if (g2 > 1) { c /= g2; b /= g2; }
+            overflow = __builtin_mul_overflow(a, c, &n) || __builtin_mul_overflow(b, d, &m);
+            return overflow ? x : Value{true, n, m, 0.0};
+        }
+        if (op == "%") {
+            // Remainder with the sign of the dividend, like std::fmod: x - y * trunc(x / y).
+            int64_t p, q;
+            overflow = __builtin_mul_overflow(a, d, &p) || __builtin_mul_overflow(b, c, &q) ||
+                       (p == INT64_MIN && q == -1);
+            if (overflow) return x;
+            Value product = applyExact(y, Value{true, p / q, 1, 0.0}, "*", overflow);
+            return overflow ? x : applyExact(x, product, "-", overflow);
+        }
+        if (op == "^") {
+            if (d != 1) {
+                overflow = true;  // Fractional exponents are not rational in general.
+                return x;
+            }
+            bool invert = c < 0;
+            uint64_t exponent = magnitude(c);
+            int64_t base_n = a, base_d = b;
+            n = 1;
+            m = 1;
+            while (exponent > 0) {
+                if (exponent & 1) {
+                    overflow |= __builtin_mul_overflow(n, base_n, &n) || __builtin_mul_overflow(m, base_d, &m);
+                }
+                exponent >>= 1;
+                if (exponent > 0) {
+                    overflow |= __builtin_mul_overflow(base_n, base_n, &base_n) ||
+                                __builtin_mul_overflow(base_d, base_d, &base_d);
+                }
+                if (overflow) return x;
+            }
+            if (invert) {
+                if (n == 0) {
+                    throw std::runtime_error("Error: Attempted division/modulo by zero");
+                }
+                std::swap(n, m);
+            }
+            return make(n, m, &overflow);
+        }
+        throw std::runtime_error("Unknown operator");
+    }
+};
+
+// A closed interval [lower, upper] that is guaranteed to contain the exact result.
+struct Interval {
+    double lower;
+    double upper;
+};
+
+// IntervalArithmetic evaluates with intervals so one pass returns an enclosure of
+// the true result, covering both literal rounding and rounding in each step.
+// Rounding is made outward by stepping each computed bound one ulp away with
+// std::nextafter, which holds for correctly rounded +, -, * and / without
+// changing the FPU rounding mode; pow gets two ulps since libm does not
+// guarantee correct rounding.
+struct IntervalArithmetic {
+    using Value = Interval;
+
+    static constexpr double infinity = std::numeric_limits<double>::infinity();
+
+    Value fromLiteral(const Token& token) const {
+        double value = token.number;
+        if (isExactLiteral(token.value, value)) {
+            return Value{value, value};
+        }
+        return Value{down(value), up(value)};
+    }
+
+    bool isZero(const Value& value) const { return value.lower == 0.0 && value.upper == 0.0; }
+
+    Value negate(const Value& value) const { return Value{-value.upper, -value.lower}; }
+
+    Value apply(const Value& left, const Value& right, const std::string& op) const {
+        if (op == "+") return Value{down(left.lower + right.lower), up(left.upper + right.upper)};
+        if (op == "-") return Value{down(left.lower - right.upper), up(left.upper - right.lower)};
+        if (op == "*") return multiply(left, right);
+        if (op == "/") return divide(left, right);
+        if (op == "%") return remainder(left, right);
+        if (op == "^") return power(left, right);
+        if (isComparison(op)) return compare(left, right, op);
+        throw std::runtime_error("Unknown operator");
+    }
+
+    std::string format(const Value& value) const {
+        std::ostringstream oss;
+        oss << std::setprecision(17) << "[" << value.lower << ", " << value.upper << "]";
+        return oss.str();
+    }
+
+private:
+    // Whether the literal converted to value without rounding, so "2.0" and
+    // "0.5" stay points while "0.1" is widened. The literal is M * 10^k (or
+    // M * 2^k for hex) and is exact when it reduces to an odd integer below
+    // 2^53 times a power of two; anything too long to check counts as rounded.
+    static bool isExactLiteral(const std::string& text, double value) {
+        if (value == 0.0) return true;  // Underflow is rejected by the tokenizer.
+        if (!(std::fabs(value) >= 2 * std::numeric_limits<double>::min()) || std::isinf(value)) return false;
+        bool hex = text.size() > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X');
+        uint64_t base = hex ? 16 : 10, mantissa = 0;
+        int64_t scale = 0, zeros = 0;
+        bool fraction = false;
+        size_t i = hex ? 2 : 0;
+        for (; i < text.size() && text[i] != 'e' && text[i] != 'E' && text[i] != 'p' && text[i] != 'P'; ++i) {
+            if (text[i] == '.') {
+                fraction = true;
+                continue;
+            }
+            unsigned char c = static_cast<unsigned char>(text[i]);
+            uint64_t digit = std::isdigit(c) ? c - '0' : std::tolower(c) - 'a' + 10;
+            scale -= fraction;
+            if (digit == 0) {
+                ++zeros;  // Trailing zeros only move the scale.
+                continue;
+            }
+            for (; zeros >= 0; --zeros) {
+                if (__builtin_mul_overflow(mantissa, base, &mantissa)) return false;
+            }
+            mantissa += digit;
+            zeros = 0;
+        }
+        scale += zeros;
+        if (i < text.size()) {
+            int64_t exponent = 0;
+            const char* first = text.data() + i + 1;
+            if (*first == '+') ++first;
+            if (std::from_chars(first, text.data() + text.size(), exponent).ec != std::errc()) return false;
+            if (exponent > 100000 || exponent < -100000) return false;
+            scale += exponent;
+        }
+        if (hex) {
+            scale = 0;  // A power of two times the digits, exact for any scale in range.
+        } else if (scale < 0) {
+            // M / 10^-k has a finite binary expansion only if 5^-k divides M.
+            for (; scale < 0; ++scale) {
+                if (mantissa % 5 != 0) return false;
+                mantissa /= 5;
+            }
+        } else {
+            for (; scale > 0; --scale) {
+                if (__builtin_mul_overflow(mantissa, uint64_t(5), &mantissa)) return false;
+            }
+        }
+        while (mantissa % 2 == 0) mantissa /= 2;
+        return mantissa < (uint64_t(1) << 53);
+    }
+
+    static double down(double x) { return std::nextafter(x, -infinity); }
+    static double up(double x) { return std::nextafter(x, infinity); }
+
+    // Endpoint product where 0 * infinity counts as 0, as interval rules require.
+    static double product(double a, double b) { return (a == 0.0 || b == 0.0) ? 0.0 : a * b; }
+
+    static Value hull(const double (&candidates)[4]) {
+        double lower = std::min(std::min(candidates[0], candidates[1]), std::min(candidates[2], candidates[3]));
+        double upper = std::max(std::max(candidates[0], candidates[1]), std::max(candidates[2], candidates[3]));
+        return Value{down(lower), up(upper)};
+    }
+
+    static Value multiply(const Value& a, const Value& b) {
+        double candidates[4] = {product(a.lower, b.lower), product(a.lower, b.upper),
+                                product(a.upper, b.lower), product(a.upper, b.upper)};
+        return hull(candidates);
+    }
+
+    static Value divide(const Value& a, const Value& b) {
+        if (a.lower == 0.0 && a.upper == 0.0) {
+            return a;  // 0 / x is 0 for every nonzero x in b.
+        }
+        if (b.lower > 0.0 || b.upper < 0.0) {
+            double candidates[4] = {a.lower / b.lower, a.lower / b.upper, a.upper / b.lower, a.upper / b.upper};
+            return hull(candidates);
+        }
+        // The divisor touches zero: the quotient is unbounded on at least one side.
+        if (b.lower == 0.0) {
+            if (a.lower >= 0.0) return Value{down(a.lower / b.upper), infinity};
+            if (a.upper <= 0.0) return Value{-infinity, up(a.upper / b.upper)};
+        } else if (b.upper == 0.0) {
+            if (a.lower >= 0.0) return Value{-infinity, up(a.lower / b.lower)};
+            if (a.upper <= 0.0) return Value{down(a.upper / b.lower), infinity};
+        }
+        return Value{-infinity, infinity};
+    }
+
+    // Enclosure of fmod(x, y) = x - y * trunc(x / y) over the whole box.
+    static Value remainder(const Value& x, const Value& y) {
+        // |fmod(x, y)| is below |y| and |x|, and has the sign of x.
+        double limit = std::max(std::fabs(y.lower), std::fabs(y.upper));
+        Value bound{std::max(x.lower, -limit), std::min(x.upper, limit)};
+        if (x.lower >= 0.0) bound.lower = 0.0;
+        if (x.upper <= 0.0) bound.upper = 0.0;
+
+        // If trunc(x / y) is the same everywhere, x - y * t is much tighter.
+        if (y.lower > 0.0 || y.upper < 0.0) {
+            Value quotient = divide(x, y);
+            double t = std::trunc(quotient.lower);
+            if (std::isfinite(t) && t == std::trunc(quotient.upper)) {
+                Value exact = multiply(y, Value{t, t});
+                exact = Value{down(x.lower - exact.upper), up(x.upper - exact.lower)};
+                bound.lower = std::max(bound.lower, exact.lower);
+                bound.upper = std::min(bound.upper, exact.upper);
+            }
+        }
+        return bound;
+    }
+
+    // A comparison is only answered when it has the same outcome for every
+    // pair of points in the two intervals.
+    static Value compare(const Value& a, const Value& b, const std::string& op) {
+        bool always, never;
+        if (op == "<" || op == ">=") {
+            always = a.upper < b.lower;
+            never = a.lower >= b.upper;
+        } else if (op == ">" || op == "<=") {
+            always = a.lower > b.upper;
+            never = a.upper <= b.lower;
+        } else {
+            always = a.lower == a.upper && b.lower == b.upper && a.lower == b.lower;
+            never = a.upper < b.lower || b.upper < a.lower;
+        }
+        if (op == ">=" || op == "<=" || op == "!=") std::swap(always, never);  // Negations of the above.
+        if (!always && !never) {
+            throw std::runtime_error("Error: Comparison is uncertain for overlapping intervals");
+        }
+        return always ? Value{1.0, 1.0} : Value{0.0, 0.0};
+    }
+
+    static double powDown(double x, double y) { return down(down(std::pow(x, y))); }
+    static double powUp(double x, double y) { return up(up(std::pow(x, y))); }
+
+    static Value power(const Value& base, const Value& exponent) {
+        double n = exponent.lower;
+        if (n == exponent.upper && n == std::trunc(n)) {
+            // Whole exponent: x^n is monotonic on each side of zero.
+            if (n == 0.0) return Value{1.0, 1.0};
+            if (n < 0.0) return divide(Value{1.0, 1.0}, power(base, Value{-n, -n}));
+            bool odd = std::fmod(n, 2.0) == 1.0;
+            if (odd || base.lower >= 0.0) {
+                return Value{powDown(base.lower, n), powUp(base.upper, n)};
+            }
+            if (base.upper <= 0.0) {
+                return Value{powDown(base.upper, n), powUp(base.lower, n)};
+            }
+            return Value{0.0, std::max(powUp(base.lower, n), powUp(base.upper, n))};
+        }
+        if (base.lower < 0.0) {
+            throw std::runtime_error("Error: Fractional power of an interval containing negative numbers");
+        }
+        // For x >= 0, x^y is monotonic in each argument, so the corners bound it.
+        double corners[4] = {std::pow(base.lower, exponent.lower), std::pow(base.lower, exponent.upper),
+                             std::pow(base.upper, exponent.lower), std::pow(base.upper, exponent.upper)};
+        Value result = hull(corners);
+        return Value{std::max(0.0, down(result.lower)), up(result.upper)};
+    }
+};
+
+// Apply a binary operator token with a backend. Backends may overload this
+// to use what reduceConstantDivisors precomputed on the token.
+template <typename Arithmetic>
+typename Arithmetic::Value applyOperator(const Arithmetic& arithmetic, const typename Arithmetic::Value& left,
+                                         const typename Arithmetic::Value& right, const Token& token) {
+    return arithmetic.apply(left, right, token.value);
+}
+
+// Modular powers use the exact exponent that resolveExponents stored.
+uint64_t applyOperator(const ModularArithmetic& arithmetic, const uint64_t& left, const uint64_t& right,
+                       const Token& token) {
+    if (token.exactExponent) return arithmetic.power(left, token.exponent);
+    return arithmetic.apply(left, right, token.value);
+}
+
+// Integer division by a literal: the quotient of the magnitudes comes from a
+// multiply-high and a shift instead of a hardware divide.
+IntegerValue applyOperator(const IntegerArithmetic& arithmetic, const IntegerValue& left,
+                           const IntegerValue& right, const Token& token) {
+    if (token.divisorShift == 0 || !left.exact || !right.exact) {
+        return arithmetic.apply(left, right, token.value);
+    }
+    uint64_t dividend = left.integer < 0 ? 0 - static_cast<uint64_t>(left.integer) : static_cast<uint64_t>(left.integer);
+    uint64_t divisor = right.integer < 0 ? 0 - static_cast<uint64_t>(right.integer) : static_cast<uint64_t>(right.integer);
+    uint64_t high = static_cast<uint64_t>((static_cast<unsigned __int128>(dividend) * token.divisorMultiplier) >> 64);
+    uint64_t quotient = (high + ((dividend - high) >> 1)) >> (token.divisorShift - 1);
+    uint64_t remainder = dividend - quotient * divisor;
+    // Truncating division: the remainder takes the sign of the dividend.
+    int64_t signedRemainder = left.integer < 0 ? -static_cast<int64_t>(remainder) : static_cast<int64_t>(remainder);
+    if (token.value == "%") return IntegerArithmetic::exact(signedRemainder);
+    if (remainder != 0) return IntegerArithmetic::real(left.toDouble() / right.toDouble());
+    int64_t signedQuotient = static_cast<int64_t>(quotient);  // |divisor| >= 2, so it fits.
+    return IntegerArithmetic::exact((left.integer < 0) != (right.integer < 0) ? -signedQuotient : signedQuotient);
+}
+
+// Backend-specific rewrites of a division by the nonzero literal divisor;
+// none by default.
+template <typename Arithmetic>
+void reduceDivision(const Arithmetic&, Token&, Token&, bool) {}
+
+// Real mode: x / c becomes x * (1 / c) when that is exact, or always when
+// reciprocal is set (the result may then differ in the last bit).
+void reduceDivision(const DoubleArithmetic&, Token& divisor, Token& op, bool reciprocal) {
+    double inverse = 1.0 / divisor.number;
+    if (op.value == "/" && (hasExactReciprocal(divisor.number) || (reciprocal && std::isfinite(inverse)))) {
+        divisor.number = inverse;
+        op.value = "*";
+        op.constantDivisor = false;
+    }
+}
+
+// Integer mode: precompute the Granlund-Montgomery multiplier for the
+// divisor's magnitude d >= 2: with l = ceil(log2 d),
+// m = floor(2^64 * (2^l - d) / d) + 1, and n / d is
+// (h + ((n - h) >> 1)) >> (l - 1) where h is the high half of n * m.
+void reduceDivision(const IntegerArithmetic& arithmetic, Token& divisor, Token& op, bool) {
+    IntegerValue value = arithmetic.fromLiteral(divisor);
+    uint64_t d = value.integer < 0 ? 0 - static_cast<uint64_t>(value.integer) : static_cast<uint64_t>(value.integer);
+    if (!value.exact || d < 2) return;
+    int l = 64 - __builtin_clzll(d - 1);
+    unsigned __int128 numerator = static_cast<unsigned __int128>((static_cast<unsigned __int128>(1) << l) - d) << 64;
+    op.divisorMultiplier = static_cast<uint64_t>(numerator / d) + 1;
+    op.divisorShift = static_cast<uint8_t>(l);
+}
+
+// Compile-time pass over the RPN: every "/" or "%" whose divisor is a
+// literal that the backend reads as nonzero is marked, so the evaluator
+// skips its zero check, and the backend may rewrite the division. A literal
+// the backend rejects is left for the evaluator to report in order.
+// The result is a vector, which the evaluator reads as is.
+template <typename Arithmetic>
+std::vector<Token> reduceConstantDivisors(std::queue<Token> rpn, const Arithmetic& arithmetic, bool reciprocal) {
+    std::vector<Token> tokens;
+    tokens.reserve(rpn.size());
+    for (; !rpn.empty(); rpn.pop()) {
+        Token& op = tokens.emplace_back(std::move(rpn.front()));
+        if (tokens.size() < 2 || (op.value != "/" && op.value != "%") || op.type != TokenType::OPERATOR) continue;
+        Token& divisor = tokens[tokens.size() - 2];  // The operand right before a binary operator is its right side.
+        if (divisor.type != TokenType::NUMBER) continue;
+        try {
+            if (arithmetic.isZero(arithmetic.fromLiteral(divisor))) continue;
+        } catch (const std::runtime_error&) {
+            continue;
+        }
+        op.constantDivisor = true;
+        reduceDivision(arithmetic, divisor, op, reciprocal);
+    }
+    return tokens;
+}
+
+// StructuralHash is a 128-bit hash of an expression in canonical form, wide
+// enough that caches can key by it without keeping the expression's text.
+// Each half is an independent 64-bit lane.
+struct StructuralHash {
+    uint64_t high = 0;
+    uint64_t low = 0;
+
+    bool operator==(const StructuralHash& other) const { return high == other.high && low == other.low; }
+    bool operator!=(const StructuralHash& other) const { return !(*this == other); }
+    bool operator<(const StructuralHash& other) const {
+        return high != other.high ? high < other.high : low < other.low;
+    }
+
+    // splitmix64 finalizer.
+    static uint64_t mix(uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    static StructuralHash ofText(const std::string& text) {
+        StructuralHash hash{0x9e3779b97f4a7c15ULL ^ text.size(), 0xc2b2ae3d27d4eb4fULL ^ text.size()};
+        for (size_t i = 0; i < text.size(); i += 8) {
+            uint64_t chunk = 0;
+            std::memcpy(&chunk, text.data() + i, std::min<size_t>(8, text.size() - i));
+            hash.high = mix(hash.high ^ chunk);
+            hash.low = mix(hash.low + chunk);
+        }
+        return hash;
+    }
+
+    // Order-sensitive: a.then(b) and b.then(a) differ.
+    StructuralHash then(const StructuralHash& next) const {
+        return StructuralHash{mix(high ^ mix(next.high + 0x632be59bd9b4e019ULL)), mix(low ^ mix(next.low ^ 0x8cb92ba72f3d8dd7ULL))};
+    }
+
+    // Summing the terms of operands gives a hash that ignores their order.
+    StructuralHash term() const { return StructuralHash{mix(high ^ 0x27d4eb2f165667c5ULL), mix(low + 0x165667b19e3779f9ULL)}; }
+    StructuralHash operator+(const StructuralHash& other) const { return StructuralHash{high + other.high, low + other.low}; }
+};
+
+struct StructuralHashHasher {
+    size_t operator()(const StructuralHash& hash) const { return static_cast<size_t>(hash.low); }
+};
+
+// The spelling of a number literal that every backend reads exactly like the
+// original: no leading zeros, a lowercase exponent without '+' or leading
+// zeros, hex integers in lowercase and hex floats by value, so "007" matches
+// "7", ".5" matches "0.5", "5E+0" matches "5e0" and "0x0FF" matches "0xff".
+// A literal with a fraction or exponent never matches a whole number: "5",
+// "5.0" and "5e0" stay apart, since integer, modular and big integer modes
+// read only digit strings as whole numbers. Trailing fraction digits stay too,
+// as they decide whether rational mode reads the literal exactly.
+std::string canonicalLiteral(const Token& token) {
+    const std::string& text = token.value;
+    if (isHexLiteral(text) && token.isInteger) {
+        size_t first = std::min(text.find_first_not_of('0', 2), text.size() - 1);
+        std::string canonical = "0x" + text.substr(first);
+        for (char& c : canonical) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        return canonical;
+    }
+    if (isHexLiteral(text)) {
+        char buffer[64];
+        auto result = std::to_chars(buffer, buffer + sizeof(buffer), token.number, std::chars_format::hex);
+        return "0x" + std::string(buffer, result.ptr);
+    }
+    size_t exponentAt = std::min(text.find_first_of("eE"), text.size());
+    size_t first = 0;
+    while (first + 1 < exponentAt && text[first] == '0' && text[first + 1] != '.') ++first;
+    std::string canonical = (text[first] == '.' ? "0" : "") + text.substr(first, exponentAt - first);
+    if (exponentAt < text.size()) {
+        size_t digits = exponentAt + 1;
+        bool negative = text[digits] == '-';
+        digits += text[digits] == '-' || text[digits] == '+';
+        digits = std::min(text.find_first_not_of('0', digits), text.size() - 1);
+        canonical += negative && text.find_first_not_of('0', digits) != std::string::npos ? "e-" : "e";
+        canonical += text.substr(digits);
+    }
+    return canonical;
+}
+
+// Operators whose operands may be swapped without changing the result in
+// any backend; for IEEE doubles a + b and a * b are exactly b + a and b * a.
+bool isCommutative(const std::string& op) {
+    return op == "+" || op == "*" || op == "==" || op == "!=";
+}
+
+// a > b is b < a and a >= b is b <= a; returns the mirrored operator, or
+// nullptr for any other.
+const char* mirroredComparison(const std::string& op) {
+    return op == ">" ? "<" : op == ">=" ? "<=" : nullptr;
+}
+
+// Canonical hashes of every subtree of an RPN expression: hashes[i] is the
+// StructuralHash of the subtree ending at token i, which starts at
+// start[i]. The canonical form has no parentheses (RPN has none), canonical
+// literal spellings, commutative operands in no particular order and a > b
+// written as b < a. With reassociate, chains of + or * are also flattened,
+// so (a + b) + c matches a + (b + c); that is exact only in modular mode,
+// and elsewhere only wanted with fast math. Returns false for malformed RPN.
+bool structuralHashes(const std::vector<Token>& rpn, bool reassociate, std::vector<size_t>& start,
+                      std::vector<StructuralHash>& hashes) {
+    size_t n = rpn.size();
+    start.assign(n, 0);
+    hashes.assign(n, StructuralHash());
+    std::vector<StructuralHash> bags(n);  // Sum of operand terms, for commutative operators.
+    std::vector<size_t> stack;
+    for (size_t i = 0; i < n; ++i) {
+        const Token& token = rpn[i];
+        if (token.type == TokenType::NUMBER || token.type == TokenType::IDENTIFIER) {
+            std::string text = token.type == TokenType::NUMBER ? "#" + canonicalLiteral(token) : "$" + token.value;
+            if (token.type == TokenType::NUMBER) {
+                text.append(reinterpret_cast<const char*>(&token.number), sizeof(token.number));  // Passes may change the number.
+            }
+            start[i] = i;
+            hashes[i] = StructuralHash::ofText(text);
+            stack.push_back(i);
+            continue;
+        }
+        size_t operands = token.value == "~" ? 1 : 2;
+        if (token.type != TokenType::OPERATOR || stack.size() < operands) return false;
+        size_t right = stack.back();
+        size_t left = operands == 2 ? stack[stack.size() - 2] : right;
+        stack.resize(stack.size() - operands);
+        start[i] = start[left];
+        if (operands == 1) {
+            hashes[i] = StructuralHash::ofText(token.value).then(hashes[right]);
+        } else if (isCommutative(token.value)) {
+            auto operand = [&](size_t child) {
+                bool chained = reassociate && (token.value == "+" || token.value == "*") &&
+                               rpn[child].type == TokenType::OPERATOR && rpn[child].value == token.value;
+                return chained ? bags[child] : hashes[child].term();
+            };
+            bags[i] = operand(left) + operand(right);
+            hashes[i] = StructuralHash::ofText(token.value).then(bags[i]);
+        } else if (const char* mirrored = mirroredComparison(token.value)) {
+            hashes[i] = StructuralHash::ofText(mirrored).then(hashes[right]).then(hashes[left]);
+        } else {
+            hashes[i] = StructuralHash::ofText(token.value).then(hashes[left]).then(hashes[right]);
+        }
+        stack.push_back(i);
+    }
+    return stack.size() == 1;
+}
+
+// Fast-math rewrite of an RPN expression into its canonical order: every
+// chain of + or * is flattened and its operands sorted by hash, the operands
+// of == and != are sorted, and a > b becomes b < a. Equivalent expressions
+// then evaluate identically and share memo entries, but real and interval
+// results may differ in the last bits from the order written, integer and
+// rational ones may overflow elsewhere, and of several errors another may be
+// reported first, so evaluateWith only calls this in fast-math mode.
+std::queue<Token> canonicalize(std::queue<Token> parsedExpression) {
+    std::vector<Token> rpn;
+    rpn.reserve(parsedExpression.size());
+    for (; !parsedExpression.empty(); parsedExpression.pop()) {
+        rpn.push_back(std::move(parsedExpression.front()));
+    }
+    std::vector<size_t> start;
+    std::vector<StructuralHash> hashes;
+    if (rpn.empty() || !structuralHashes(rpn, true, start, hashes)) {
+        // Left as it is for the evaluator to report.
+        return std::queue<Token>(std::deque<Token>(std::make_move_iterator(rpn.begin()), std::make_move_iterator(rpn.end())));
+    }
+
+    // Depth-first over the tree, without recursion: an item either visits
+    // the subtree ending at index or emits the token at index, renamed to op
+    // when that is set. Items are pushed in reverse order.
+    struct Work {
+        size_t index;
+        bool emit;
+        const char* op;
+    };
+    std::vector<Work> work{{rpn.size() - 1, false, nullptr}};
+    std::vector<size_t> operands, pending;
+    std::vector<Token> output;
+    output.reserve(rpn.size());
+    while (!work.empty()) {
+        Work item = work.back();
+        work.pop_back();
+        const Token& token = rpn[item.index];
+        if (item.emit || token.type != TokenType::OPERATOR) {
+            output.push_back(token);
+            if (item.op) output.back().value = item.op;
+            continue;
+        }
+        if (token.value == "~") {
+            work.push_back({item.index, true, nullptr});
+            work.push_back({item.index - 1, false, nullptr});
+            continue;
+        }
+        size_t right = item.index - 1;
+        size_t left = start[right] - 1;
+        if (const char* mirrored = mirroredComparison(token.value)) {
+            work.push_back({item.index, true, mirrored});
+            work.push_back({left, false, nullptr});
+            work.push_back({right, false, nullptr});
+            continue;
+        }
+        if (!isCommutative(token.value)) {
+            work.push_back({item.index, true, nullptr});
+            work.push_back({right, false, nullptr});
+            work.push_back({left, false, nullptr});
+            continue;
+        }
+        // Gather the operands of the whole chain, then emit them in hash order.
+        operands.clear();
+        pending.assign({left, right});
+        bool chains = token.value == "+" || token.value == "*";
+        while (!pending.empty()) {
+            size_t j = pending.back();
+            pending.pop_back();
+            if (chains && rpn[j].type == TokenType::OPERATOR && rpn[j].value == token.value) {
+                pending.push_back(start[j - 1] - 1);
+                pending.push_back(j - 1);
+            } else {
+                operands.push_back(j);
+            }
+        }
+        std::sort(operands.begin(), operands.end(), [&](size_t a, size_t b) { return hashes[a] < hashes[b]; });
+        for (size_t k = operands.size() - 1; k > 0; --k) {
+            work.push_back({item.index, true, nullptr});
+            work.push_back({operands[k], false, nullptr});
+        }
+        work.push_back({operands[0], false, nullptr});
+    }
+    return std::queue<Token>(std::deque<Token>(std::make_move_iterator(output.begin()), std::make_move_iterator(output.end())));
+}
+
+// Approximate memory held by a cached value, for the memo's byte limit.
+template <typename Value>
+size_t approximateBytes(const Value&) { return sizeof(Value); }
+
+size_t approximateBytes(const BigInteger& value) { return sizeof(BigInteger) + value.bitLength() / 8; }
+
+size_t approximateBytes(const RationalValue& value) {
+    return sizeof(RationalValue) + (value.bigNumerator.bitLength() + value.bigDenominator.bitLength()) / 8;
+}
+
+// Counters of a SubexpressionCache, for the statistics screen.
+struct MemoStatistics {
+    uint64_t hits = 0;       // Subtrees whose value was reused.
+    uint64_t misses = 0;     // Subtrees looked up and computed.
+    uint64_t evictions = 0;  // Entries dropped to stay within the limits.
+    size_t entries = 0;
+    size_t bytes = 0;
+};
+
+// SubexpressionCache remembers the values of constant subtrees across
+// evaluations, so a costly subexpression that appears in many expressions
+// (e.g. the same normalizing factor) is computed once. Subtrees are keyed by
+// the StructuralHash of their canonical form, so 2^x * 3 also finds the
+// value of 3 * 2^x; at 128 bits a collision is not a practical concern, and
+// no text is kept. With reassociate, chains of + and * match in any
+// grouping, which is only right for backends where that is exact. Only
+// subtrees costing at least minimumCost are cached, where a power
+// counts 8 and any other operator 1, since cheaper ones are faster to
+// recompute than to look up. The cache is split into shards, each with its
+// own lock and least-recently-used list, and is bounded by entry count and
+// by bytes.
+template <typename Value>
+class SubexpressionCache {
+public:
+    static constexpr uint32_t minimumCost = 8;
+    static constexpr size_t shardCount = 16;
+
+    explicit SubexpressionCache(bool reassociate = false, size_t capacity = 16384, size_t maxBytes = size_t(64) << 20)
+        : reassociate(reassociate), shardCapacity(std::max<size_t>(1, capacity / shardCount)),
+          shardBytes(maxBytes / shardCount) {}
+
+    // A cached subtree spanning tokens [start, end].
+    struct Hit {
+        size_t start;
+        size_t end;
+        Value value;
+    };
+
+    // A cacheable subtree ending at token end that was not found.
+    struct Miss {
+        size_t end;
+        StructuralHash key;
+    };
+
+    // The hits ordered by start and the misses ordered by end. Subtrees
+    // inside a hit are neither looked up nor stored.
+    struct Plan {
+        std::vector<Hit> hits;
+        std::vector<Miss> misses;
+    };
+
+    // Look up every cacheable constant subtree of tokens, outermost first.
+    // context separates values that depend on more than the tokens, such as
+    // the modulus. A malformed expression gets an empty plan; the evaluator
+    // reports it.
+    Plan plan(const std::vector<Token>& tokens, uint64_t context) {
+        Plan result;
+        size_t n = tokens.size();
+        std::vector<size_t> start;
+        std::vector<StructuralHash> hash;
+        if (!structuralHashes(tokens, reassociate, start, hash)) return result;
+        std::vector<uint32_t> cost(n);
+        std::vector<char> constant(n);
+        for (size_t i = 0; i < n; ++i) {
+            const Token& token = tokens[i];
+            if (token.type != TokenType::OPERATOR) {
+                constant[i] = token.type == TokenType::NUMBER;
+                continue;
+            }
+            size_t right = i - 1;
+            size_t left = token.value == "~" ? right : start[right] - 1;
+            cost[i] = cost[left] + (left != right ? cost[right] : 0) + (token.value == "^" ? 8 : 1);
+            constant[i] = constant[left] && constant[right];
+        }
+
+        size_t coveredFrom = n;  // Start of the last hit; ends at or after it lie inside it.
+        for (size_t i = n; i-- > 0;) {
+            if (tokens[i].type != TokenType::OPERATOR || !constant[i] || cost[i] < minimumCost || i >= coveredFrom) {
+                continue;
+            }
+            StructuralHash key = hash[i].then(StructuralHash{context, context});
+            Value value;
+            if (find(key, value)) {
+                result.hits.push_back(Hit{start[i], i, std::move(value)});
+                coveredFrom = start[i];
+            } else {
+                result.misses.push_back(Miss{i, key});
+            }
+        }
+        std::reverse(result.hits.begin(), result.hits.end());
+        std::reverse(result.misses.begin(), result.misses.end());
+        return result;
+    }
+
+    // Remember the value computed for a missed subtree.
+    void store(const Miss& miss, const Value& value) {
+        Shard& shard = shards[miss.key.high % shardCount];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.entries.find(miss.key);
+        if (it != shard.entries.end()) {
+            // A concurrent store of the same subtree; keep the newer.
+            shard.bytes -= it->second.bytes;
+            shard.recency.erase(it->second.position);
+            shard.entries.erase(it);
+        }
+        size_t bytes = sizeof(Entry) + approximateBytes(value);
+        if (bytes > shardBytes) return;
+        while (!shard.recency.empty() && (shard.entries.size() >= shardCapacity || shard.bytes + bytes > shardBytes)) {
+            auto oldest = shard.entries.find(shard.recency.back());
+            shard.bytes -= oldest->second.bytes;
+            shard.entries.erase(oldest);
+            shard.recency.pop_back();
+            ++shard.evictions;
+        }
+        shard.recency.push_front(miss.key);
+        shard.entries.emplace(miss.key, Entry{value, bytes, shard.recency.begin()});
+        shard.bytes += bytes;
+    }
+
+    MemoStatistics statistics() const {
+        MemoStatistics total;
+        for (const Shard& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            total.hits += shard.hits;
+            total.misses += shard.misses;
+            total.evictions += shard.evictions;
+            total.entries += shard.entries.size();
+            total.bytes += shard.bytes;
+        }
+        return total;
+    }
+
+private:
+    struct Entry {
+        Value value;
+        size_t bytes;
+        std::list<StructuralHash>::iterator position;  // In recency.
+    };
+
+    struct Shard {
+        mutable std::mutex mutex;
+        std::unordered_map<StructuralHash, Entry, StructuralHashHasher> entries;
+        std::list<StructuralHash> recency;  // Keys, most recently used first.
+        size_t bytes = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+    };
+
+    bool find(const StructuralHash& key, Value& value) {
+        Shard& shard = shards[key.high % shardCount];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.entries.find(key);
+        if (it == shard.entries.end()) {
+            ++shard.misses;
+            return false;
+        }
+        shard.recency.splice(shard.recency.begin(), shard.recency, it->second.position);
+        ++shard.hits;
+        value = it->second.value;
+        return true;
+    }
+
+    bool reassociate;  // Hash chains of + and * regardless of grouping.
+    size_t shardCapacity;
+    size_t shardBytes;
+    Shard shards[shardCount];
+};
+
+// The process-wide memo for a backend's values. Only modular arithmetic is
+// associative exactly.
+template <typename Arithmetic>
+SubexpressionCache<typename Arithmetic::Value>& subexpressionCache() {
+    static SubexpressionCache<typename Arithmetic::Value> cache(std::is_same<Arithmetic, ModularArithmetic>::value);
+    return cache;
+}
+
+// RefinedEvaluator class evaluates the expression represented in RPN, using the
+// numeric backend given as template argument (double by default).
+template <typename Arithmetic = DoubleArithmetic>
+class RefinedEvaluator {
+public:
+    using Value = typename Arithmetic::Value;
+
+    // With a memo, constant subtrees found there are not recomputed, and the
+    // ones computed are added to it; memoContext is passed on to its plan.
+    explicit RefinedEvaluator(Arithmetic arithmetic = Arithmetic(), SubexpressionCache<Value>* memo = nullptr,
+                              uint64_t memoContext = 0)
+        : arithmetic(arithmetic), memo(memo), memoContext(memoContext) {}
+
+    // Switch to another backend configuration (e.g. modulus) and memo,
+    // keeping the operand stack that earlier evaluations have grown.
+    void configure(Arithmetic newArithmetic, SubexpressionCache<Value>* newMemo, uint64_t newMemoContext) {
+        arithmetic = newArithmetic;
+        memo = newMemo;
+        memoContext = newMemoContext;
+    }
+
+    // Evaluate the parsed expression (in RPN) and return the result. With a
+    // budget, every token counts as one operation. Names left in the
+    // expression are looked up in variables.
+    Value evaluate(std::queue<Token> parsedExpression, EvaluationBudget* budget = nullptr,
+                   const std::unordered_map<std::string, Value>* variables = nullptr) {
+        std::vector<Token> tokens;
+        tokens.reserve(parsedExpression.size());
+        for (; !parsedExpression.empty(); parsedExpression.pop()) {
+            tokens.push_back(std::move(parsedExpression.front()));
+        }
+        return evaluate(tokens, budget, variables);
+    }
+
+    // The same for RPN already in a vector. The operand stack is kept between
+    // calls, so once it has grown, evaluating again without a memo does not
+    // allocate in backends with plain values (real, integer and modular);
+    // "--self-test" checks this for the evaluator evaluateWith uses, in builds
+    // that track allocations.
+    Value evaluate(const std::vector<Token>& tokens, EvaluationBudget* budget = nullptr,
+                   const std::unordered_map<std::string, Value>* variables = nullptr) {
+        evaluationStack.clear();
+        typename SubexpressionCache<Value>::Plan plan;
+        if (memo) plan = memo->plan(tokens, memoContext);
+        size_t nextHit = 0, nextMiss = 0;
+
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            if (budget) budget->step();
+            if (nextHit < plan.hits.size() && plan.hits[nextHit].start == i) {
+                // A memoized subtree: push its value and skip its tokens.
+                evaluationStack.push_back(plan.hits[nextHit].value);
+                i = plan.hits[nextHit++].end;
+                continue;
+            }
+            const Token& token = tokens[i];
+
+            if (token.type == TokenType::NUMBER) {
+                // Push numbers onto the stack.
+                evaluationStack.push_back(arithmetic.fromLiteral(token));
+            } else if (token.type == TokenType::IDENTIFIER) {
+                // Variables have values only where the caller supplies them (e.g. cells).
+                if (!variables || variables->count(token.value) == 0) {
+                    throw std::runtime_error("Error: Unknown variable '" + token.value + "'");
+                }
+                evaluationStack.push_back(variables->at(token.value));
+            } else if (token.type == TokenType::OPERATOR) {
+                // Evaluate the operator with operands from the stack.
+                if (token.value == "~") {
+                    // Unary operator handling.
+                    if (evaluationStack.empty()) {
+                        throw std::runtime_error("Error: Insufficient operands for unary operator");
+                    }
+                    Value operand = std::move(evaluationStack.back()); evaluationStack.pop_back();
+                    evaluationStack.push_back(arithmetic.negate(operand));
+                } else {
+                    // Binary operator handling.
+                    if (evaluationStack.size() < 2) {
+                        throw std::runtime_error("Error: Insufficient operands for operator '" + token.value + "'");
+                    }
+                    Value right = std::move(evaluationStack.back()); evaluationStack.pop_back();
+                    Value left = std::move(evaluationStack.back()); evaluationStack.pop_back();
+
+                    if ((token.value == "/" || token.value == "%") && !token.constantDivisor && arithmetic.isZero(right)) {
+                        throw std::runtime_error("Error: Attempted division/modulo by zero");
+                    }
+
+                    evaluationStack.push_back(applyOperator(arithmetic, left, right, token));
+                }
+            }
+            if (nextMiss < plan.misses.size() && plan.misses[nextMiss].end == i) {
+                memo->store(plan.misses[nextMiss++], evaluationStack.back());
+            }
+        }
+
+        if (evaluationStack.size() != 1) {
+            throw std::runtime_error("Error: Invalid expression format");
+        }
+
+        return evaluationStack.back();  // Return the final result.
+    }
+
+    // Format a result of this evaluator for display and history.
+    std::string format(const Value& value) const {
+        return arithmetic.format(value);
+    }
+
+private:
+    Arithmetic arithmetic;  // The numeric backend and its settings.
+    SubexpressionCache<Value>* memo;
+    uint64_t memoContext;
+    std::vector<Value> evaluationStack;  // Intermediate results, reused by every evaluation.
+};
+
+// Backend-specific preparation of the exponents of "^"; none by default.
+template <typename Arithmetic>
+std::queue<Token> resolveExponents(std::queue<Token> rpn, const Arithmetic&) {
+    return rpn;
+}
+
+// Modular mode: a residue is not enough to raise to (a ^ m is not a ^ 0
+// modulo m), so the right operand of every "^" is evaluated as an exact
+// 64-bit integer, replaced by its literal, and stored in the "^" token.
+// Exponents nested inside are resolved first. An exponent that is not a
+// whole number from 0 to 2^63 - 1 is an error. Malformed RPN is left for
+// the evaluator to report.
+std::queue<Token> resolveExponents(std::queue<Token> rpn, const ModularArithmetic&) {
+    std::vector<Token> output;
+    std::vector<size_t> starts;  // Where each operand on the stack starts in output.
+    output.reserve(rpn.size());
+    for (; !rpn.empty(); rpn.pop()) {
+        Token token = std::move(rpn.front());
+        if (token.type != TokenType::OPERATOR) {
+            starts.push_back(output.size());
+        } else {
+            size_t operands = token.value == "~" ? 1 : 2;
+            if (starts.size() < operands) {
+                output.push_back(std::move(token));
+                for (rpn.pop(); !rpn.empty(); rpn.pop()) output.push_back(std::move(rpn.front()));
+                break;
+            }
+            size_t right = starts.back();
+            starts.resize(starts.size() - operands + 1);  // The result starts where the left operand did.
+            if (token.value == "^") {
+                std::queue<Token> exponentRpn(std::deque<Token>(output.begin() + right, output.end()));
+                IntegerValue exponent = RefinedEvaluator<IntegerArithmetic>().evaluate(std::move(exponentRpn));
+                if (!exponent.exact || exponent.integer < 0) {
+                    throw std::runtime_error("Error: Exponents in modular mode must be whole numbers from 0 to 2^63 - 1");
+                }
+                Token literal{std::to_string(exponent.integer), TokenType::NUMBER};
+                literal.isInteger = true;
+                literal.number = static_cast<double>(exponent.integer);
+                output.resize(right);
+                output.push_back(std::move(literal));
+                token.exactExponent = true;
+                token.exponent = static_cast<uint64_t>(exponent.integer);
+            }
+        }
+        output.push_back(std::move(token));
+    }
+    return std::queue<Token>(std::deque<Token>(std::make_move_iterator(output.begin()), std::make_move_iterator(output.end())));
+}
+
+// The value of a result as a double, for the history; NaN when it has none.
+template <typename Arithmetic>
+double numericValue(const Arithmetic&, const typename Arithmetic::Value& value) { return value.toDouble(); }
+
+double numericValue(const DoubleArithmetic&, double value) { return value; }
+
+double numericValue(const ModularArithmetic& arithmetic, uint64_t value) {
+    return static_cast<double>(arithmetic.residue(value));
+}
+
+double numericValue(const IntervalArithmetic&, const Interval&) { return std::numeric_limits<double>::quiet_NaN(); }
+
+// Numeric modes selectable from the menu. History exports store them as a
+// byte, so new modes go at the end.
+enum class NumericMode {
+    REAL,     // Double-precision floating point.
+    INTEGER,  // Exact 64-bit integers, promoted to double on overflow.
+    MODULAR,  // Residues modulo settings.modulus.
+    RATIONAL,     // Exact fractions, promoted to big integers on overflow.
+    BIG_INTEGER,  // Arbitrary-precision whole numbers.
+    INTERVAL      // Intervals guaranteed to enclose the exact result.
+};
+
+// Settings chosen by the user for the current session.
+struct CalculatorSettings {
+    NumericMode mode = NumericMode::REAL;
+    uint64_t modulus = 0;  // Modulus used in modular mode.
+    uint64_t maxOperations = 0;        // Per-expression operation budget; 0 means unlimited.
+    uint64_t timeoutMilliseconds = 0;  // Per-expression time limit; 0 means unlimited.
+    bool reciprocalDivision = false;   // Real mode: divide by any literal through its reciprocal.
+    bool memoizeSubexpressions = false; // Reuse values of costly constant subtrees across expressions.
+    bool fastMath = false;             // Evaluate sums and products in canonical rather than written order.
+};
+
+// The evaluator of this thread for a backend, configured for arithmetic. It
+// is kept so that its operand stack is sized once, not on every evaluation.
+template <typename Arithmetic>
+RefinedEvaluator<Arithmetic>& threadEvaluator(Arithmetic arithmetic, SubexpressionCache<typename Arithmetic::Value>* memo,
+                                              uint64_t memoContext) {
+    thread_local RefinedEvaluator<Arithmetic> evaluator(arithmetic);
+    evaluator.configure(arithmetic, memo, memoContext);
+    return evaluator;
+}
+
+// Evaluate the parsed expression with the backend of the selected mode and
+// return the formatted result. Constant divisors are reduced here rather
+// than before caching, since what they reduce to depends on the mode, as are
+// modular exponents, and in fast-math mode the expression is first put in
+// canonical order. With value, the result is also stored there as a double.
+template <typename Arithmetic>
+std::string evaluateWith(const std::queue<Token>& parsedExpression, Arithmetic arithmetic,
+                         const CalculatorSettings& settings, EvaluationBudget* budget, double* value) {
+    std::vector<Token> prepared = reduceConstantDivisors(
+        resolveExponents(settings.fastMath ? canonicalize(parsedExpression) : parsedExpression, arithmetic),
+        arithmetic, settings.reciprocalDivision);
+    // Modular values also depend on the modulus.
+    uint64_t context = std::is_same<Arithmetic, ModularArithmetic>::value ? settings.modulus : 0;
+    RefinedEvaluator<Arithmetic>& evaluator = threadEvaluator(
+        arithmetic, settings.memoizeSubexpressions ? &subexpressionCache<Arithmetic>() : nullptr, context);
+    auto result = evaluator.evaluate(prepared, budget);
+    if (value) *value = numericValue(arithmetic, result);
+    return evaluator.format(result);
+}
+
+std::string evaluateInMode(const std::queue<Token>& parsedExpression, const CalculatorSettings& settings, EvaluationBudget* budget = nullptr, double* value = nullptr) {
+    AllocationTracker::Scope scope(PipelineStage::EVALUATE);
+    AllocationTracker::countEvaluation();
+    switch (settings.mode) {
+        case NumericMode::INTEGER:
+            return evaluateWith(parsedExpression, IntegerArithmetic(), settings, budget, value);
+        case NumericMode::MODULAR:
+            return evaluateWith(parsedExpression, ModularArithmetic(settings.modulus), settings, budget, value);
+        case NumericMode::RATIONAL:
+            return evaluateWith(parsedExpression, RationalArithmetic(), settings, budget, value);
+        case NumericMode::BIG_INTEGER:
+            return evaluateWith(parsedExpression, BigIntegerArithmetic(), settings, budget, value);
+        case NumericMode::INTERVAL:
+            return evaluateWith(parsedExpression, IntervalArithmetic(), settings, budget, value);
+        case NumericMode::REAL:
+        default:
+            return evaluateWith(parsedExpression, DoubleArithmetic(), settings, budget, value);
+    }
+}
+
+// Print the subexpression memo counters of every mode that has used it.
+void printMemoStatistics(std::ostream& out) {
+    auto print = [&out](const char* mode, const MemoStatistics& statistics) {
+        uint64_t lookups = statistics.hits + statistics.misses;
+        if (lookups == 0) return;
+        out << "memo (" << mode << "): " << statistics.hits << " hits, " << statistics.misses << " misses ("
+            << std::fixed << std::setprecision(1) << 100.0 * statistics.hits / lookups << "% hit rate), "
+            << statistics.entries << " entries, " << statistics.bytes / 1024 << " KiB, "
+            << statistics.evictions << " evictions\n" << std::defaultfloat << std::setprecision(6);
+    };
+    print("real", subexpressionCache<DoubleArithmetic>().statistics());
+    print("integer", subexpressionCache<IntegerArithmetic>().statistics());
+    print("modular", subexpressionCache<ModularArithmetic>().statistics());
+    print("rational", subexpressionCache<RationalArithmetic>().statistics());
+    print("big integer", subexpressionCache<BigIntegerArithmetic>().statistics());
+    print("interval", subexpressionCache<IntervalArithmetic>().statistics());
+}
+
+// Print the allocation counters of every pipeline stage that allocated, with
+// averages per evaluation. Prints nothing unless allocations are tracked.
+void printAllocationStatistics(std::ostream& out) {
+    if (!AllocationTracker::enabled) return;
+    static const char* const names[] = {"other", "tokenize", "inline", "parse", "evaluate"};
+    uint64_t evaluations = std::max<uint64_t>(1, AllocationTracker::evaluations());
+    for (int stage = 0; stage < static_cast<int>(PipelineStage::COUNT); ++stage) {
+        AllocationStatistics statistics = AllocationTracker::statistics(static_cast<PipelineStage>(stage));
+        if (statistics.allocations == 0) continue;
+        out << "allocations (" << names[stage] << "): " << statistics.allocations << " ("
+            << std::fixed << std::setprecision(1) << static_cast<double>(statistics.allocations) / evaluations
+            << " per evaluation), " << statistics.bytes << " bytes ("
+            << static_cast<double>(statistics.bytes) / evaluations << " per evaluation), peak "
+            << statistics.peakLiveBytes << " live bytes\n" << std::defaultfloat << std::setprecision(6);
+    }
+}
+
+// TrigramIndex maps every three-character substring to the ids of the strings
+// that contain it, in increasing order. A substring query intersects the
+// lists of its trigrams and only checks the surviving candidates, so search
+// time depends on the number of matches rather than on the history size.
+// Adding a string costs one push_back per distinct trigram.
+class TrigramIndex {
+public:
+    // Index text under id; ids must be added in increasing order.
+    void add(uint32_t id, const std::string& text) {
+        for (size_t i = 0; i + 3 <= text.size(); ++i) {
+            auto& postings = lists[key(text, i)];
+            if (postings.empty() || postings.back() != id) {
+                postings.push_back(id);
+            }
+        }
+    }
+
+    // Ids of strings that may contain query, or all ids below count if
+    // the query is too short to use the index.
+    std::vector<uint32_t> candidates(const std::string& query, uint32_t count) const {
+        std::vector<uint32_t> result;
+        if (query.size() < 3) {
+            result.resize(count);
+            for (uint32_t id = 0; id < count; ++id) result[id] = id;
+            return result;
+        }
+        // Start from the rarest trigram and intersect the others into it.
+        std::vector<const std::vector<uint32_t>*> postings;
+        for (size_t i = 0; i + 3 <= query.size(); ++i) {
+            auto it = lists.find(key(query, i));
+            if (it == lists.end()) return result;
+            postings.push_back(&it->second);
+        }
+        std::sort(postings.begin(), postings.end(),
+                  [](const std::vector<uint32_t>* a, const std::vector<uint32_t>* b) { return a->size() < b->size(); });
+        result = *postings.front();
+        for (size_t i = 1; i < postings.size() && !result.empty(); ++i) {
+            std::vector<uint32_t> narrowed;
+            std::set_intersection(result.begin(), result.end(), postings[i]->begin(), postings[i]->end(),
+                                  std::back_inserter(narrowed));
+            result.swap(narrowed);
+        }
+        return result;
+    }
+
+private:
+    static uint32_t key(const std::string& text, size_t i) {
+        return (static_cast<uint32_t>(static_cast<unsigned char>(text[i])) << 16) |
+               (static_cast<uint32_t>(static_cast<unsigned char>(text[i + 1])) << 8) |
+               static_cast<unsigned char>(text[i + 2]);
+    }
+
+    std::unordered_map<uint32_t, std::vector<uint32_t>> lists;  // Posting list per trigram.
+};
+
+// StringPool stores each distinct string once and hands out 32-bit ids for
+// them. Strings live in a deque so their addresses, and the views used as
+// lookup keys, stay valid as the pool grows.
+class StringPool {
+public:
+    // Return the id of text, adding it if it is new; isNew reports which.
+    uint32_t intern(const std::string& text, bool& isNew) {
+        auto it = ids.find(text);
+        isNew = it == ids.end();
+        if (!isNew) {
+            return it->second;
+        }
+        uint32_t id = static_cast<uint32_t>(strings.size());
+        strings.push_back(text);
+        ids.emplace(strings.back(), id);
+        storedBytes += text.size();
+        return id;
+    }
+
+    const std::string& get(uint32_t id) const { return strings[id]; }
+    size_t size() const { return strings.size(); }
+    uint64_t getStoredBytes() const { return storedBytes; }
+
+private:
+    std::deque<std::string> strings;                     // Strings by id.
+    std::unordered_map<std::string_view, uint32_t> ids;  // Ids by string.
+    uint64_t storedBytes = 0;                            // Characters held by the pool.
+};
+
+// Result categories stored in the columnar history export.
+enum class ResultCode : uint8_t {
+    OK = 0,                     // A number; the value column holds it.
+    INVALID_EXPRESSION = 1,
+    DIVISION_BY_ZERO = 2,
+    INSUFFICIENT_OPERANDS = 3,
+    LIMIT_EXCEEDED = 4,         // Operation budget, timeout or cancellation.
+    DEFINITION = 5,             // The line defined a function.
+    NOT_NUMERIC = 6,            // A result with no double value, e.g. an interval.
+    OTHER_ERROR = 7
+};
+
+// Classify a formatted result of the given mode. The numeric value comes from
+// the evaluation itself, not from the text, which may be rounded.
+ResultCode classifyResult(const std::string& result, NumericMode mode) {
+    if (result.rfind("Defined ", 0) == 0) return ResultCode::DEFINITION;
+    if (result.rfind("Error", 0) == 0) {
+        if (result.find("Invalid expression") != std::string::npos) return ResultCode::INVALID_EXPRESSION;
+        if (result.find("by zero") != std::string::npos) return ResultCode::DIVISION_BY_ZERO;
+        if (result.find("Insufficient operands") != std::string::npos) return ResultCode::INSUFFICIENT_OPERANDS;
+        if (result.find("budget") != std::string::npos || result.find("timed out") != std::string::npos ||
+            result.find("cancelled") != std::string::npos) {
+            return ResultCode::LIMIT_EXCEEDED;
+        }
+        return ResultCode::OTHER_ERROR;
+    }
+    return mode == NumericMode::INTERVAL ? ResultCode::NOT_NUMERIC : ResultCode::OK;
+}
+
+// Layout of a columnar history file. All integers are little-endian and every
+// section starts at the 8-byte aligned offset given here, so each column can
+// be memory-mapped directly as a plain array (e.g. numpy.memmap):
+//   expressionIds   uint32[rows]  index into the expression dictionary
+//   results         float64[rows] numeric result as evaluated, NaN when there is none
+//   codes           uint8[rows]   ResultCode
+//   timestamps      uint32[rows]  seconds since the Unix epoch
+//   dictionaryIndex uint64[dictionarySize + 1] start of each expression in dictionaryData
+//   dictionaryData  char[]        the distinct expressions, concatenated
+//   modes           uint8[rows]   NumericMode the row was evaluated in
+//   moduli          uint64[rows]  modulus in modular mode, otherwise 0
+// Version 1 files end at dictionaryData and have an 80-byte header without
+// the last two offsets.
+struct ColumnarHeader {
+    char magic[8];  // "CALCHIST"
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t rows;
+    uint64_t dictionarySize;
+    uint64_t expressionIdsOffset;
+    uint64_t resultsOffset;
+    uint64_t codesOffset;
+    uint64_t timestampsOffset;
+    uint64_t dictionaryIndexOffset;
+    uint64_t dictionaryDataOffset;
+    uint64_t modesOffset;
+    uint64_t moduliOffset;
+};
+static_assert(sizeof(ColumnarHeader) == 96, "ColumnarHeader must match the file layout");
+
+// ColumnarHistory holds an exported history read back into memory, e.g. for replay.
+struct ColumnarHistory {
+    std::vector<uint32_t> expressionIds;
+    std::vector<double> results;
+    std::vector<uint8_t> codes;
+    std::vector<uint32_t> timestamps;
+    std::vector<std::string> expressions;  // The expression dictionary.
+    std::vector<uint8_t> modes;            // Empty for version 1 files.
+    std::vector<uint64_t> moduli;
+
+    // Load a file written by CalculatorHistory::exportColumnar.
+    static ColumnarHistory read(const std::string& path) {
+        std::ifstream file(path, std::ios::binary);
+        ColumnarHeader header = {};
+        const size_t versionOneSize = offsetof(ColumnarHeader, modesOffset);
+        if (!file || !file.read(reinterpret_cast<char*>(&header), versionOneSize) ||
+            std::string(header.magic, sizeof(header.magic)) != "CALCHIST" || header.version < 1 ||
+            header.version > 2 ||
+            (header.version == 2 && !file.read(reinterpret_cast<char*>(&header) + versionOneSize,
+                                               sizeof(header) - versionOneSize))) {
+            throw std::runtime_error("Error: '" + path + "' is not a columnar history file");
+        }
+        file.seekg(0, std::ios::end);
+        const uint64_t fileSize = static_cast<uint64_t>(file.tellg());
+
+        // Every column must lie inside the file before anything is allocated
+        // for it, so a corrupt count or offset is an error rather than a huge
+        // allocation.
+        auto inside = [&](uint64_t offset, uint64_t count, uint64_t width) {
+            return count <= fileSize / width && offset <= fileSize - count * width;
+        };
+        if (!inside(header.expressionIdsOffset, header.rows, sizeof(uint32_t)) ||
+            !inside(header.resultsOffset, header.rows, sizeof(double)) ||
+            !inside(header.codesOffset, header.rows, sizeof(uint8_t)) ||
+            !inside(header.timestampsOffset, header.rows, sizeof(uint32_t)) ||
+            header.dictionarySize >= fileSize / sizeof(uint64_t) ||
+            !inside(header.dictionaryIndexOffset, header.dictionarySize + 1, sizeof(uint64_t)) ||
+            header.dictionaryDataOffset > fileSize ||
+            (header.version >= 2 && (!inside(header.modesOffset, header.rows, sizeof(uint8_t)) ||
+                                     !inside(header.moduliOffset, header.rows, sizeof(uint64_t))))) {
+            throw std::runtime_error("Error: '" + path + "' is truncated");
+        }
+
+        ColumnarHistory history;
+        auto column = [&](auto& values, uint64_t offset, uint64_t count) {
+            values.resize(count);
+            file.seekg(static_cast<std::streamoff>(offset));
+            file.read(reinterpret_cast<char*>(values.data()),
+                      static_cast<std::streamsize>(count * sizeof(values[0])));
+        };
+        std::vector<uint64_t> index;
+        column(index, header.dictionaryIndexOffset, header.dictionarySize + 1);
+        if (!file) {
+            throw std::runtime_error("Error: '" + path + "' is truncated");
+        }
+        // The index must start at 0, never decrease and end inside the file.
+        for (uint64_t i = 0; i < header.dictionarySize; ++i) {
+            if (index[i] > index[i + 1]) {
+                throw std::runtime_error("Error: '" + path + "' has a corrupt dictionary");
+            }
+        }
+        if (index.front() != 0 || !inside(header.dictionaryDataOffset, index.back(), 1)) {
+            throw std::runtime_error("Error: '" + path + "' has a corrupt dictionary");
+        }
+
+        column(history.expressionIds, header.expressionIdsOffset, header.rows);
+        column(history.results, header.resultsOffset, header.rows);
+        column(history.codes, header.codesOffset, header.rows);
+        column(history.timestamps, header.timestampsOffset, header.rows);
+        std::string data;
+        column(data, header.dictionaryDataOffset, index.back());
+        if (header.version >= 2) {
+            column(history.modes, header.modesOffset, header.rows);
+            column(history.moduli, header.moduliOffset, header.rows);
+        }
+        if (!file) {
+            throw std::runtime_error("Error: '" + path + "' is truncated");
+        }
+        for (uint64_t i = 0; i < header.dictionarySize; ++i) {
+            history.expressions.push_back(data.substr(index[i], index[i + 1] - index[i]));
+        }
+        for (uint32_t id : history.expressionIds) {
+            if (id >= history.expressions.size()) {
+                throw std::runtime_error("Error: '" + path + "' has a corrupt expression id");
+            }
+        }
+        for (uint8_t mode : history.modes) {
+            if (mode > static_cast<uint8_t>(NumericMode::INTERVAL)) {
+                throw std::runtime_error("Error: '" + path + "' has a corrupt mode");
+            }
+        }
+        return history;
+    }
+};
+
+// CalculatorHistory class maintains a history of expressions evaluated.
+// Expressions and results are interned, so an entry is two string ids and a
+// timestamp, and a repeated expression or result costs no extra text. The
+// numeric value and mode of each entry, needed only for export, are kept in
+// parallel columns.
+class CalculatorHistory {
+public:
+    // One evaluation: ids into the string pool and when it happened.
+    struct Entry {
+        uint32_t expression;
+        uint32_t result;
+        uint32_t timestamp;  // Seconds since the Unix epoch.
+    };
+    static_assert(sizeof(Entry) == 12, "Entry should stay three 32-bit fields");
+
+    // Add an entry to the history with the expression, its result and the
+    // value and settings it was evaluated with.
+    void addEntry(const std::string& expression, const std::string& result, double value,
+                  const CalculatorSettings& settings) {
+        auto now = std::chrono::system_clock::now().time_since_epoch();
+        Entry entry{intern(expression), intern(result),
+                    static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::seconds>(now).count())};
+        history.push_back(entry);
+        values.push_back(value);
+        modeIds.push_back(internMode(settings));
+        addedBytes += expression.size() + result.size();
+    }
+
+    // Display the history of expressions and their results.
+    void showHistory() const {
+        if (history.empty()) {
+            std::cout << "\n--------------------------------------------------------------------------------\n";
+            std::cout << "\nNo previous instances.\n";
+            return;
+        }
+        std::cout << "\n--------------------------------------------------------------------------------\n";
+        std::cout << "\nHistory:\n";
+        for (const auto& entry : history) {
+            std::cout << "\nExpression: " << strings.get(entry.expression)
+                      << " | Result: " << strings.get(entry.result) << "\n";
+        }
+        std::cout << "\n" << history.size() << " entries, " << strings.size() << " distinct strings, "
+                  << "deduplication ratio " << std::fixed << std::setprecision(2) << dedupRatio() << "\n";
+        std::cout.unsetf(std::ios::fixed);
+    }
+
+    // Characters added through addEntry per character actually stored.
+    double dedupRatio() const {
+        return strings.getStoredBytes() ? static_cast<double>(addedBytes) / strings.getStoredBytes() : 1.0;
+    }
+
+    // Write the history to path in the columnar format described at
+    // ColumnarHeader. Columns are streamed from the compact entries through a
+    // fixed buffer.
+    void exportColumnar(const std::string& path) const {
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            throw std::runtime_error("Error: Cannot create '" + path + "'");
+        }
+
+        // Number the distinct expressions densely; the pool also holds results.
+        const uint32_t unassigned = std::numeric_limits<uint32_t>::max();
+        std::vector<uint32_t> dictionaryIds(strings.size(), unassigned);
+        std::vector<uint32_t> dictionary;  // Pool ids in dictionary order.
+        for (const Entry& entry : history) {
+            if (dictionaryIds[entry.expression] == unassigned) {
+                dictionaryIds[entry.expression] = static_cast<uint32_t>(dictionary.size());
+                dictionary.push_back(entry.expression);
+            }
+        }
+
+        auto align = [](uint64_t offset) { return (offset + 7) & ~uint64_t(7); };
+        uint64_t rows = history.size();
+        ColumnarHeader header = {{'C', 'A', 'L', 'C', 'H', 'I', 'S', 'T'}, 2, 0, rows, dictionary.size(),
+                                 0, 0, 0, 0, 0, 0, 0, 0};
+        header.expressionIdsOffset = sizeof(header);
+        header.resultsOffset = align(header.expressionIdsOffset + rows * sizeof(uint32_t));
+        header.codesOffset = align(header.resultsOffset + rows * sizeof(double));
+        header.timestampsOffset = align(header.codesOffset + rows * sizeof(uint8_t));
+        header.dictionaryIndexOffset = align(header.timestampsOffset + rows * sizeof(uint32_t));
+        header.dictionaryDataOffset = align(header.dictionaryIndexOffset + (dictionary.size() + 1) * sizeof(uint64_t));
+        uint64_t dictionaryBytes = 0;
+        for (uint32_t id : dictionary) dictionaryBytes += strings.get(id).size();
+        header.modesOffset = align(header.dictionaryDataOffset + dictionaryBytes);
+        header.moduliOffset = align(header.modesOffset + rows * sizeof(uint8_t));
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        // Stream one column at a time through a buffer, padding to its offset.
+        std::vector<char> buffer;
+        buffer.reserve(1 << 20);
+        auto writeColumn = [&](uint64_t offset, size_t count, auto valueAt) {
+            static const char padding[8] = {};
+            file.write(padding, static_cast<std::streamsize>(offset - static_cast<uint64_t>(file.tellp())));
+            for (size_t i = 0; i < count; ++i) {
+                auto value = valueAt(i);
+                const char* bytes = reinterpret_cast<const char*>(&value);
+                buffer.insert(buffer.end(), bytes, bytes + sizeof(value));
+                if (buffer.size() >= (1 << 20)) {
+                    file.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+                    buffer.clear();
+                }
+            }
+            file.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+            buffer.clear();
+        };
+
+        writeColumn(header.expressionIdsOffset, rows, [&](size_t i) { return dictionaryIds[history[i].expression]; });
+        writeColumn(header.resultsOffset, rows, [&](size_t i) { return values[i]; });
+        writeColumn(header.codesOffset, rows, [&](size_t i) {
+            return static_cast<uint8_t>(classifyResult(strings.get(history[i].result), modes[modeIds[i]].mode));
+        });
+        writeColumn(header.timestampsOffset, rows, [&](size_t i) { return history[i].timestamp; });
+        uint64_t start = 0;
+        writeColumn(header.dictionaryIndexOffset, dictionary.size() + 1, [&](size_t i) {
+            uint64_t offset = start;
+            if (i < dictionary.size()) start += strings.get(dictionary[i]).size();
+            return offset;
+        });
+        writeColumn(header.dictionaryDataOffset, 0, [](size_t) { return 0; });
+        for (uint32_t id : dictionary) {
+            file.write(strings.get(id).data(), static_cast<std::streamsize>(strings.get(id).size()));
+        }
+        writeColumn(header.modesOffset, rows, [&](size_t i) { return static_cast<uint8_t>(modes[modeIds[i]].mode); });
+        writeColumn(header.moduliOffset, rows, [&](size_t i) { return modes[modeIds[i]].modulus; });
+        if (!file) {
+            throw std::runtime_error("Error: Failed to write '" + path + "'");
+        }
+    }
+
+    // Return the positions of entries whose expression or result contains
+    // text, or, with prefixOnly, whose expression starts with text.
+    std::vector<uint32_t> search(const std::string& text, bool prefixOnly) const {
+        // Find the matching distinct strings first, then the entries using them.
+        std::vector<bool> matching(strings.size(), false);
+        bool any = false;
+        for (uint32_t id : index.candidates(text, static_cast<uint32_t>(strings.size()))) {
+            const std::string& candidate = strings.get(id);
+            matching[id] = prefixOnly ? candidate.compare(0, text.size(), text) == 0
+                                      : candidate.find(text) != std::string::npos;
+            any |= matching[id];
+        }
+        std::vector<uint32_t> matches;
+        if (!any) {
+            return matches;
+        }
+        for (uint32_t position = 0; position < history.size(); ++position) {
+            const Entry& entry = history[position];
+            if (matching[entry.expression] || (!prefixOnly && matching[entry.result])) {
+                matches.push_back(position);
+            }
+        }
+        return matches;
+    }
+
+    // Display the entries found by search(), newest first, up to limit entries.
+    void showSearch(const std::string& text, bool prefixOnly, size_t limit = 50) const {
+        std::vector<uint32_t> matches = search(text, prefixOnly);
+        std::cout << "\n--------------------------------------------------------------------------------\n";
+        std::cout << "\n" << matches.size() << " matching entr" << (matches.size() == 1 ? "y" : "ies") << ":\n";
+        for (size_t i = 0; i < matches.size() && i < limit; ++i) {
+            uint32_t position = matches[matches.size() - 1 - i];
+            const Entry& entry = history[position];
+            std::cout << "\n#" << position + 1 << " Expression: " << strings.get(entry.expression)
+                      << " | Result: " << strings.get(entry.result) << "\n";
+        }
+        if (matches.size() > limit) {
+            std::cout << "\n(" << matches.size() - limit << " older matches not shown)\n";
+        }
+    }
+
+private:
+    // Intern text and index it the first time it is seen.
+    uint32_t intern(const std::string& text) {
+        bool isNew;
+        uint32_t id = strings.intern(text, isNew);
+        if (isNew) {
+            index.add(id, text);
+        }
+        return id;
+    }
+
+    // Index of the mode of settings in modes, adding it the first time.
+    uint32_t internMode(const CalculatorSettings& settings) {
+        uint64_t modulus = settings.mode == NumericMode::MODULAR ? settings.modulus : 0;
+        for (uint32_t i = 0; i < modes.size(); ++i) {
+            if (modes[i].mode == settings.mode && modes[i].modulus == modulus) return i;
+        }
+        modes.push_back({settings.mode, modulus});
+        return static_cast<uint32_t>(modes.size() - 1);
+    }
+
+    struct Mode {
+        NumericMode mode;
+        uint64_t modulus;
+    };
+
+    std::vector<Entry> history;     // Entries, oldest first.
+    std::vector<double> values;     // Per entry: the result as a double; NaN when there is none.
+    std::vector<uint32_t> modeIds;  // Per entry: index into modes.
+    std::vector<Mode> modes;        // Every distinct mode used, usually one or two.
+    StringPool strings;             // Every distinct expression and result.
+    TrigramIndex index;             // Search index over the pooled strings.
+    uint64_t addedBytes = 0;        // Characters passed to addEntry, before deduplication.
+};
+
+// FunctionLibrary stores the functions defined with "def f(x, y) = expr" during
+// a session. Calls are inlined into the caller's token stream before parsing,
+// so the parsed expression never contains call frames.
+class FunctionLibrary {
+public:
+    // Check whether the input is a function definition rather than an expression.
+    static bool isDefinition(const std::string& input) {
+        std::istringstream iss(input);
+        std::string word;
+        return (iss >> word) && word == "def";
+    }
+
+    // Store the definition and return its signature, e.g. "f(x, y)".
+    // The body may only call functions that are already defined, so recursive
+    // definitions are rejected as calls to an unknown function.
+    std::string define(const std::string& definition, EnhancedTokenizer& tokenizer) {
+        size_t equals = definition.find('=');
+        if (equals == std::string::npos) {
+            throw std::runtime_error("Error: Expected '=' in function definition");
+        }
+        std::vector<Token> head = tokenizer.tokenize(definition.substr(0, equals));
+        std::vector<Token> body = tokenizer.tokenize(definition.substr(equals + 1));
+
+        // The head must look like: def name ( param , param ... )
+        if (head.size() < 4 || head[0].value != "def" || head[1].type != TokenType::IDENTIFIER ||
+            head[2].value != "(" || head.back().value != ")") {
+            throw std::runtime_error("Error: Expected 'def name(params) = expression'");
+        }
+        if (head[head.size() - 2].type == TokenType::SEPARATOR) {
+            throw std::runtime_error("Error: Empty parameter name");  // e.g. "def f(x,)".
+        }
+        std::vector<std::string> params;
+        for (size_t i = 3; i + 1 < head.size(); i += 2) {
+            if (head[i].type != TokenType::IDENTIFIER ||
+                (i + 2 < head.size() && head[i + 1].type != TokenType::SEPARATOR)) {
+                throw std::runtime_error("Error: Invalid parameter list");
+            }
+            for (const auto& param : params) {
+                if (param == head[i].value) {
+                    throw std::runtime_error("Error: Duplicate parameter '" + param + "'");
+                }
+            }
+            params.push_back(head[i].value);
+        }
+        if (body.empty() || (body.size() == 1 && body.front().type == TokenType::INVALID)) {
+            throw std::runtime_error("Error: Invalid function body");
+        }
+
+        // Inline calls in the body now, so stored bodies never contain calls.
+        Function function{params, inlineCalls(body, &params)};
+
+        // Make sure the body parses once parameters are replaced by operands.
+        std::vector<Token> probe = function.body;
+        for (auto& token : probe) {
+            if (token.type == TokenType::IDENTIFIER) {
+                token = Token{"1", TokenType::NUMBER};
+            }
+        }
+        if (ImprovedParser().parse(probe).empty()) {
+            throw std::runtime_error("Error: Invalid function body");
+        }
+
+        const std::string& name = head[1].value;
+        functions[name] = function;
+        ++generation;
+        return signature(name);
+    }
+
+    // Replace every call to a user-defined function by its body, with each
+    // parameter replaced by the parenthesized argument. Identifiers listed in
+    // params (if any) are left in place.
+    std::vector<Token> inlineCalls(const std::vector<Token>& tokens,
+                                   const std::vector<std::string>* params = nullptr) const {
+        std::vector<Token> output;
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            const Token& token = tokens[i];
+            if (token.type != TokenType::IDENTIFIER) {
+                output.push_back(token);
+                continue;
+            }
+            if (params && std::find(params->begin(), params->end(), token.value) != params->end()) {
+                output.push_back(token);
+                continue;
+            }
+            auto it = functions.find(token.value);
+            if (it == functions.end()) {
+                throw std::runtime_error("Error: Unknown function '" + token.value + "'");
+            }
+            if (i + 1 >= tokens.size() || tokens[i + 1].value != "(") {
+                throw std::runtime_error("Error: Expected '(' after '" + token.value + "'");
+            }
+
+            // Split the argument list at top-level separators.
+            std::vector<std::vector<Token>> arguments(1);
+            int depth = 0;
+            size_t j = i + 2;
+            for (; j < tokens.size(); ++j) {
+                if (tokens[j].value == "(") {
+                    ++depth;
+                } else if (tokens[j].value == ")") {
+                    if (depth == 0) break;
+                    --depth;
+                } else if (tokens[j].type == TokenType::SEPARATOR && depth == 0) {
+                    arguments.emplace_back();
+                    continue;
+                }
+                arguments.back().push_back(tokens[j]);
+            }
+            if (j >= tokens.size()) {
+                throw std::runtime_error("Error: Unmatched parentheses in call to '" + token.value + "'");
+            }
+            if (arguments.size() == 1 && arguments[0].empty()) {
+                arguments.clear();
+            }
+
+            const Function& function = it->second;
+            if (arguments.size() != function.params.size()) {
+                throw std::runtime_error("Error: '" + signature(token.value) + "' expects " +
+                                         std::to_string(function.params.size()) + " argument(s)");
+            }
+            for (auto& argument : arguments) {
+                if (argument.empty()) {
+                    throw std::runtime_error("Error: Empty argument in call to '" + token.value + "'");
+                }
+                argument = inlineCalls(argument, params);
+            }
+
+            output.push_back(Token{"(", TokenType::PARENTHESIS});
+            for (const auto& bodyToken : function.body) {
+                auto param = std::find(function.params.begin(), function.params.end(), bodyToken.value);
+                if (bodyToken.type == TokenType::IDENTIFIER && param != function.params.end()) {
+                    const auto& argument = arguments[param - function.params.begin()];
+                    output.push_back(Token{"(", TokenType::PARENTHESIS});
+                    output.insert(output.end(), argument.begin(), argument.end());
+                    output.push_back(Token{")", TokenType::PARENTHESIS});
+                } else {
+                    output.push_back(bodyToken);
+                }
+            }
+            output.push_back(Token{")", TokenType::PARENTHESIS});
+
+            // Nested definitions can double in size at every level; cap the result.
+            if (output.size() > maxInlinedTokens) {
+                throw std::runtime_error("Error: Expression is too large after inlining functions");
+            }
+            i = j;  // Continue after the closing parenthesis of the call.
+        }
+        return output;
+    }
+
+    // Changes whenever a function is defined, so caches can tell when to drop entries.
+    size_t getGeneration() const { return generation; }
+
+    // Display the functions defined in this session.
+    void showFunctions() const {
+        if (functions.empty()) {
+            return;
+        }
+        std::cout << "\nFunctions:\n";
+        for (const auto& entry : functions) {
+            std::cout << "\n" << signature(entry.first) << "\n";
+        }
+    }
+
+private:
+    struct Function {
+        std::vector<std::string> params;  // Parameter names in call order.
+        std::vector<Token> body;          // Body tokens with all calls already inlined.
+    };
+
+    std::string signature(const std::string& name) const {
+        std::string text = name + "(";
+        const auto& params = functions.at(name).params;
+        for (size_t i = 0; i < params.size(); ++i) {
+            text += (i ? ", " : "") + params[i];
+        }
+        return text + ")";
+    }
+
+    static constexpr size_t maxInlinedTokens = 100000;  // Limit on the size of an inlined expression.
+    std::map<std::string, Function> functions;  // Functions by name.
+    size_t generation = 0;  // Incremented on every definition.
+};
+
+// ExpressionCache maps expression text to its parsed RPN so repeated
+// expressions skip tokenizing, inlining and parsing. It is emptied when the
+// function library changes, since a call may then mean something else, and
+// when it reaches its capacity. Access is serialized by a mutex.
+class ExpressionCache {
+public:
+    explicit ExpressionCache(size_t capacity = 65536) : capacity(capacity) {}
+
+    bool find(const std::string& expression, size_t libraryGeneration, std::queue<Token>& parsed) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (libraryGeneration != generation) {
+            return false;
+        }
+        auto it = entries.find(expression);
+        if (it == entries.end()) {
+            return false;
+        }
+        parsed = it->second;
+        return true;
+    }
+
+    void store(const std::string& expression, size_t libraryGeneration, const std::queue<Token>& parsed) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (libraryGeneration != generation || entries.size() >= capacity) {
+            entries.clear();
+            generation = libraryGeneration;
+        }
+        entries.emplace(expression, parsed);
+    }
+
+private:
+    std::mutex mutex;
+    size_t capacity;        // Maximum number of entries.
+    size_t generation = 0;  // FunctionLibrary generation the entries were parsed with.
+    std::unordered_map<std::string, std::queue<Token>> entries;
+};
+
+// Nanoseconds spent in each stage of one evaluateExpression call. A stage
+// that did not run, such as parsing after a cache hit, stays negative.
+struct StageTimings {
+    double tokenize = -1.0;
+    double parse = -1.0;  // Inlining included.
+    double evaluate = -1.0;
+};
+
+// Run one line of input through the whole pipeline: store it if it is a
+// function definition, otherwise tokenize, inline calls, parse and evaluate it
+// in the selected mode. Errors are returned as the result text. With a cache,
+// parsed expressions are looked up and stored there. The operation and time
+// limits in settings and the cancellation token, if any, bound the work. With
+// value, the result is also stored there as a double (NaN when there is none),
+// and with timings, the time each stage took.
+std::string evaluateExpression(const std::string& expression, FunctionLibrary& functions, EnhancedTokenizer& tokenizer, ImprovedParser& parser, const CalculatorSettings& settings, ExpressionCache* cache = nullptr, const CancellationToken* cancellation = nullptr, double* value = nullptr, StageTimings* timings = nullptr) {
+    if (value) *value = std::numeric_limits<double>::quiet_NaN();
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point stageStart;
+    auto startStage = [&]() { if (timings) stageStart = Clock::now(); };
+    auto endStage = [&](double& elapsed) {
+        if (timings) elapsed = std::chrono::duration<double, std::nano>(Clock::now() - stageStart).count();
+    };
+
+    if (FunctionLibrary::isDefinition(expression)) {
+        // Store a user-defined function instead of evaluating.
+        try {
+            return "Defined " + functions.define(expression, tokenizer);
+        } catch (const std::runtime_error& e) {
+            return e.what();
+        }
+    }
+
+    EvaluationBudget limits(settings.maxOperations, settings.timeoutMilliseconds, cancellation);
+    EvaluationBudget* budget = limits.isLimited() ? &limits : nullptr;  // Unlimited runs skip the checks.
+
+    std::queue<Token> parsedExpression;
+    if (cache && cache->find(expression, functions.getGeneration(), parsedExpression)) {
+        try {
+            startStage();
+            std::string result = evaluateInMode(parsedExpression, settings, budget, value);
+            if (timings) endStage(timings->evaluate);
+            return result;
+        } catch (const std::runtime_error& e) {
+            return e.what();
+        }
+    }
+
+    std::vector<Token> tokens;
+    try {
+        AllocationTracker::Scope scope(PipelineStage::TOKENIZE);
+        startStage();
+        tokens = tokenizer.tokenize(expression, budget);
+        if (timings) endStage(timings->tokenize);
+    } catch (const std::runtime_error& e) {
+        return e.what();
+    }
+
+    // Handling errors in tokenization, parsing, and evaluation
+    if (tokens.empty() || (tokens.size() == 1 && tokens.front().type == TokenType::INVALID)) {
+        return "Error, Invalid expression";
+    }
+    try {
+        if (budget) budget->check();
+        startStage();
+        std::vector<Token> inlined;
+        {
+            AllocationTracker::Scope scope(PipelineStage::INLINE);
+            inlined = functions.inlineCalls(tokens);
+        }
+        {
+            AllocationTracker::Scope scope(PipelineStage::PARSE);
+            parsedExpression = parser.parse(inlined, budget);
+        }
+        if (timings) endStage(timings->parse);
+        if (parsedExpression.empty()) {
+            return "Error, Invalid expression";
+        }
+        if (cache) {
+            cache->store(expression, functions.getGeneration(), parsedExpression);
+        }
+        if (budget) budget->check();
+        startStage();
+        std::string result = evaluateInMode(parsedExpression, settings, budget, value);
+        if (timings) endStage(timings->evaluate);
+        return result;
+    } catch (const std::runtime_error& e) {
+        return e.what();
+    }
+}
+
+// Code generation choices for ColumnarProgram. Estrin's scheme shortens the
+// chain of dependent operations in a polynomial at the cost of computing
+// powers of x; with block evaluation every step is already a loop over many
+// rows, so Horner's fewer operations is the default. Fused multiply-add is
+// only used when the target has it in hardware (FP_FAST_FMA), since a
+// software fma is slower than a multiply and an add. Division by a constant
+// always becomes a multiplication when the reciprocal is exact, and with
+// reciprocalDivision for any constant.
+struct ColumnarOptions {
+    bool estrin = false;
+    bool fusedMultiplyAdd = false;
+    bool reciprocalDivision = false;
+};
+
+// ColumnarProgram compiles a set of formulas over named input columns into one
+// instruction list and evaluates all of them in a single pass over the rows.
+// Identical subexpressions are shared across formulas (hash-consing), constant
+// subexpressions are folded at compile time, and rows are processed in blocks
+// of blockRows so every intermediate block stays in cache. Intermediate blocks
+// are recycled as soon as their last consumer has run. Evaluation follows
+// IEEE rules per row: x / 0 gives an infinity or NaN instead of an error.
+//
+// An optional filter keeps only the rows where it is nonzero (and not NaN).
+// Its instructions are compiled first and run on the whole block; the rows
+// that pass form a selection vector, and the remaining instructions then run
+// only on those rows. When most rows pass, the plain dense loops are used
+// instead, since skipping a few rows is not worth the indirect access.
+//
+// Polynomials in one variable of degree 2 or more, such as
+// "a * x^3 + b * x^2 + c * x + d" with constant coefficients, are recognized
+// and rewritten without pow: by Horner's scheme, or by Estrin's scheme when
+// asked for. The rewritten form is algebraically equal but may round
+// differently in the last bits, and where the written form overflows to
+// inf - inf it may give an infinity instead of NaN. Terms whose coefficient
+// comes out as 0 ("x * 0 + x^2") are never dropped.
+class ColumnarProgram {
+public:
+    static constexpr size_t blockRows = 1024;
+    static constexpr size_t maxPolynomialDegree = 16;
+
+#ifdef FP_FAST_FMA
+    static constexpr bool hardwareFma = true;
+#else
+    static constexpr bool hardwareFma = false;
+#endif
+
+    // Compile formulas; names in them must be columns or defined functions.
+    ColumnarProgram(const std::vector<std::string>& columns, const std::vector<std::string>& formulas,
+                    const FunctionLibrary& functions, const std::string& filter = "",
+                    ColumnarOptions options = ColumnarOptions())
+        : options(options) {
+        if (!filter.empty()) {
+            filterRoot = compile(parseFormula(filter, columns, functions), columns, filter);
+            filterEnd = instructions.size();
+        }
+        for (const auto& formula : formulas) {
+            roots.push_back(compile(parseFormula(formula, columns, functions), columns, formula));
+        }
+        allocateSlots();
+    }
+
+    size_t instructionCount() const { return instructions.size(); }
+    size_t slotCount() const { return slots; }
+    size_t polynomialCount() const { return polynomials; }
+
+    // Evaluate every formula for every row that passes the filter; outputs[f]
+    // holds formula f for those rows in input order. All input columns must
+    // have the same number of rows. Returns the number of rows kept.
+    size_t evaluate(const std::vector<std::vector<double>>& inputs, std::vector<std::vector<double>>& outputs) const {
+        size_t rows = inputs.empty() ? 0 : inputs.front().size();
+        outputs.assign(roots.size(), std::vector<double>(rows));
+        std::vector<double> buffers(slots * blockRows);
+        std::vector<const double*> values(instructions.size());
+        std::vector<uint32_t> selection(blockRows);
+        size_t kept = 0;
+
+        for (size_t start = 0; start < rows; start += blockRows) {
+            size_t count = std::min(blockRows, rows - start);
+            run(0, filterEnd, inputs, start, buffers, values, nullptr, count);
+            size_t selected = count;
+            if (filterEnd > 0) {
+                // Branch-free selection vector of the rows that pass.
+                const double* keep = values[filterRoot];
+                selected = 0;
+                for (size_t i = 0; i < count; ++i) {
+                    selection[selected] = static_cast<uint32_t>(i);
+                    selected += keep[i] != 0.0 && keep[i] == keep[i];
+                }
+                if (selected == 0) continue;
+            }
+            bool sparse = selected < count - count / 4;
+            run(filterEnd, instructions.size(), inputs, start, buffers, values,
+                sparse ? selection.data() : nullptr, sparse ? selected : count);
+
+            for (size_t f = 0; f < roots.size(); ++f) {
+                const double* result = values[roots[f]];
+                double* out = outputs[f].data() + kept;
+                if (selected == count) {
+                    std::copy(result, result + count, out);
+                } else {
+                    for (size_t i = 0; i < selected; ++i) out[i] = result[selection[i]];
+                }
+            }
+            kept += selected;
+        }
+        for (auto& output : outputs) output.resize(kept);
+        return kept;
+    }
+
+private:
+    struct Instruction {
+        enum Kind { CONSTANT, COLUMN, NEGATE, BINARY, MULTIPLY_ADD } kind;
+        std::string op;   // Operator of a BINARY instruction.
+        uint32_t left;    // Operand instruction, or the column index of COLUMN.
+        uint32_t right;   // Second operand of a BINARY or MULTIPLY_ADD instruction.
+        double constant;  // Value of a CONSTANT instruction.
+        uint32_t slot;    // Block buffer holding the result (not used by COLUMN).
+        uint32_t addend;  // Third operand of MULTIPLY_ADD: left * right + addend.
+    };
+
+    // A formula as a tree; left and right index the formula's other nodes.
+    struct Node {
+        Token token;
+        int left = -1;
+        int right = -1;
+    };
+
+    // The value of a subtree as sum coefficients[k] * variable^k, where the
+    // variable is an instruction; without a variable it is a constant.
+    struct Polynomial {
+        bool hasVariable;
+        uint32_t variable;
+        std::vector<double> coefficients;
+    };
+
+    static std::queue<Token> parseFormula(const std::string& formula, const std::vector<std::string>& columns,
+                                          const FunctionLibrary& functions) {
+        EnhancedTokenizer tokenizer;
+        ImprovedParser parser;
+        auto tokens = tokenizer.tokenize(formula);
+        std::queue<Token> rpn;
+        if (!tokens.empty() && !(tokens.size() == 1 && tokens.front().type == TokenType::INVALID)) {
+            rpn = parser.parse(functions.inlineCalls(tokens, &columns));
+        }
+        if (rpn.empty()) {
+            throw std::runtime_error("Error: Invalid formula '" + formula + "'");
+        }
+        return rpn;
+    }
+
+    // Call kernel(i) for rows 0..count-1 of the block, or for selection[0..count-1].
+    template <typename Kernel>
+    static void forRows(const uint32_t* selection, size_t count, Kernel kernel) {
+        if (selection) {
+            for (size_t i = 0; i < count; ++i) kernel(selection[i]);
+        } else {
+            for (size_t i = 0; i < count; ++i) kernel(i);  // Dense: vectorizes.
+        }
+    }
+
+    static void applyBinary(const std::string& op, const double* a, const double* b, double* out,
+                            const uint32_t* selection, size_t count) {
+        // One loop per operator, chosen once per block.
+        if (op == "+") forRows(selection, count, [=](size_t i) { out[i] = a[i] + b[i]; });
+        else if (op == "-") forRows(selection, count, [=](size_t i) { out[i] = a[i] - b[i]; });
+        else if (op == "*") forRows(selection, count, [=](size_t i) { out[i] = a[i] * b[i]; });
+        else if (op == "/") forRows(selection, count, [=](size_t i) { out[i] = a[i] / b[i]; });
+        else if (op == "%") forRows(selection, count, [=](size_t i) { out[i] = std::fmod(a[i], b[i]); });
+        else if (op == "^") forRows(selection, count, [=](size_t i) { out[i] = std::pow(a[i], b[i]); });
+        else if (op == "<") forRows(selection, count, [=](size_t i) { out[i] = a[i] < b[i]; });
+        else if (op == ">") forRows(selection, count, [=](size_t i) { out[i] = a[i] > b[i]; });
+        else if (op == "<=") forRows(selection, count, [=](size_t i) { out[i] = a[i] <= b[i]; });
+        else if (op == ">=") forRows(selection, count, [=](size_t i) { out[i] = a[i] >= b[i]; });
+        else if (op == "==") forRows(selection, count, [=](size_t i) { out[i] = a[i] == b[i]; });
+        else if (op == "!=") forRows(selection, count, [=](size_t i) { out[i] = a[i] != b[i]; });
+    }
+
+    // Run instructions [begin, end) on the block of count rows at start, or on
+    // the selected rows of it.
+    void run(size_t begin, size_t end, const std::vector<std::vector<double>>& inputs, size_t start,
+             std::vector<double>& buffers, std::vector<const double*>& values,
+             const uint32_t* selection, size_t count) const {
+        for (size_t k = begin; k < end; ++k) {
+            const Instruction& instruction = instructions[k];
+            if (instruction.kind == Instruction::COLUMN) {
+                values[k] = inputs[instruction.left].data() + start;  // Read in place.
+                continue;
+            }
+            double* out = &buffers[instruction.slot * blockRows];
+            values[k] = out;
+            if (instruction.kind == Instruction::CONSTANT) {
+                double constant = instruction.constant;
+                forRows(selection, count, [=](size_t i) { out[i] = constant; });
+            } else if (instruction.kind == Instruction::NEGATE) {
+                const double* a = values[instruction.left];
+                forRows(selection, count, [=](size_t i) { out[i] = -a[i]; });
+            } else if (instruction.kind == Instruction::MULTIPLY_ADD) {
+                const double* a = values[instruction.left];
+                const double* b = values[instruction.right];
+                const double* c = values[instruction.addend];
+                forRows(selection, count, [=](size_t i) { out[i] = std::fma(a[i], b[i], c[i]); });
+            } else {
+                applyBinary(instruction.op, values[instruction.left], values[instruction.right], out, selection, count);
+            }
+        }
+    }
+
+    // Return the id of an instruction, reusing an identical existing one.
+    uint32_t intern(const Instruction& instruction) {
+        std::ostringstream key;
+        key << instruction.kind << ' ' << instruction.op << ' ' << instruction.left << ' ' << instruction.right << ' '
+            << instruction.addend << ' ';
+        if (instruction.kind == Instruction::CONSTANT) {
+            uint64_t bits;
+            std::memcpy(&bits, &instruction.constant, sizeof(bits));
+            key << bits;  // Bitwise, so 0.0 and -0.0 stay distinct.
+        }
+        auto it = known.find(key.str());
+        if (it != known.end()) {
+            return it->second;
+        }
+        instructions.push_back(instruction);
+        uint32_t id = static_cast<uint32_t>(instructions.size() - 1);
+        known.emplace(key.str(), id);
+        return id;
+    }
+
+    uint32_t constant(double value) { return intern(Instruction{Instruction::CONSTANT, "", 0, 0, value, 0, 0}); }
+
+    // Commutative operands are put in id order and a > b becomes b < a, so
+    // b * a and a < b share the instructions of a * b and b > a.
+    uint32_t binary(const std::string& op, uint32_t left, uint32_t right) {
+        if (const char* mirrored = mirroredComparison(op)) {
+            return intern(Instruction{Instruction::BINARY, mirrored, right, left, 0.0, 0, 0});
+        }
+        if (isCommutative(op) && right < left) std::swap(left, right);
+        return intern(Instruction{Instruction::BINARY, op, left, right, 0.0, 0, 0});
+    }
+
+    // left * right + addend, fused when the options and the target allow it.
+    uint32_t multiplyAdd(uint32_t left, uint32_t right, uint32_t addend) {
+        if (options.fusedMultiplyAdd && hardwareFma) {
+            if (right < left) std::swap(left, right);
+            return intern(Instruction{Instruction::MULTIPLY_ADD, "", left, right, 0.0, 0, addend});
+        }
+        return binary("+", binary("*", left, right), addend);
+    }
+
+    // Turn one formula's RPN into a tree, then into instructions; returns the
+    // formula's result instruction.
+    uint32_t compile(std::queue<Token> rpn, const std::vector<std::string>& columns, const std::string& formula) {
+        std::vector<Node> nodes;
+        std::vector<int> stack;
+        auto invalid = [&]() { return std::runtime_error("Error: Invalid formula '" + formula + "'"); };
+        for (; !rpn.empty(); rpn.pop()) {
+            Node node{rpn.front()};
+            if (node.token.type == TokenType::IDENTIFIER &&
+                std::find(columns.begin(), columns.end(), node.token.value) == columns.end()) {
+                throw invalid();
+            }
+            if (node.token.type == TokenType::OPERATOR) {
+                size_t operands = node.token.value == "~" ? 1 : 2;
+                if (stack.size() < operands) throw invalid();
+                if (operands == 2) {
+                    node.right = stack.back();
+                    stack.pop_back();
+                }
+                node.left = stack.back();
+                stack.pop_back();
+            }
+            nodes.push_back(node);
+            stack.push_back(static_cast<int>(nodes.size() - 1));
+        }
+        if (stack.size() != 1) throw invalid();
+
+        Lowering lowering{nodes, columns, std::vector<std::unique_ptr<Polynomial>>(nodes.size()),
+                          std::vector<int64_t>(nodes.size(), -1)};
+        return lower(lowering, stack.back());
+    }
+
+    // Per-formula state of lower and analyze; results are memoized per node
+    // so each subtree is examined once.
+    struct Lowering {
+        const std::vector<Node>& nodes;
+        const std::vector<std::string>& columns;
+        std::vector<std::unique_ptr<Polynomial>> polynomials;  // analyze results; null when not yet known.
+        std::vector<int64_t> instructions;                     // lower results; -1 when not yet known.
+    };
+
+    // Emit the instructions for node n. Constant subtrees are folded, and
+    // polynomials of degree 2 or more get Horner's or Estrin's scheme;
+    // anything else keeps the structure it was written with.
+    uint32_t lower(Lowering& lowering, int n) {
+        if (lowering.instructions[n] >= 0) return static_cast<uint32_t>(lowering.instructions[n]);
+        const Node& node = lowering.nodes[n];
+        const Polynomial* polynomial = analyze(lowering, n);
+        uint32_t id;
+        if (polynomial && !polynomial->hasVariable) {
+            id = constant(polynomial->coefficients[0]);
+        } else if (polynomial && polynomial->coefficients.size() > 2) {
+            ++polynomials;
+            id = options.estrin ? estrin(polynomial->coefficients, 0, polynomial->coefficients.size(), polynomial->variable)
+                                : horner(polynomial->coefficients, polynomial->variable);
+        } else if (node.token.type == TokenType::IDENTIFIER) {
+            id = column(lowering, node);
+        } else if (node.token.value == "~") {
+            id = intern(Instruction{Instruction::NEGATE, "", lower(lowering, node.left), 0, 0.0, 0, 0});
+        } else if (node.token.value == "/" && dividesByReciprocal(lowering, node.right)) {
+            id = binary("*", lower(lowering, node.left), constant(1.0 / analyze(lowering, node.right)->coefficients[0]));
+        } else {
+            id = binary(node.token.value, lower(lowering, node.left), lower(lowering, node.right));
+        }
+        lowering.instructions[n] = id;
+        return id;
+    }
+
+    // Whether dividing by node n can be a multiplication by its reciprocal.
+    bool dividesByReciprocal(Lowering& lowering, int n) {
+        const Polynomial* divisor = analyze(lowering, n);
+        if (!divisor || divisor->hasVariable) return false;
+        double c = divisor->coefficients[0];
+        return hasExactReciprocal(c) || (options.reciprocalDivision && c != 0.0 && std::isfinite(1.0 / c));
+    }
+
+    uint32_t column(const Lowering& lowering, const Node& node) {
+        uint32_t index = static_cast<uint32_t>(
+            std::find(lowering.columns.begin(), lowering.columns.end(), node.token.value) - lowering.columns.begin());
+        return intern(Instruction{Instruction::COLUMN, "", index, 0, 0.0, 0, 0});
+    }
+
+    // The polynomial that node n computes, or null if it is not one. A child
+    // that is not a polynomial itself becomes the variable.
+    const Polynomial* analyze(Lowering& lowering, int n) {
+        if (lowering.polynomials[n]) {
+            return lowering.polynomials[n]->coefficients.empty() ? nullptr : lowering.polynomials[n].get();
+        }
+        Polynomial result = analyzeNode(lowering, n);
+        lowering.polynomials[n] = std::make_unique<Polynomial>(std::move(result));
+        return lowering.polynomials[n]->coefficients.empty() ? nullptr : lowering.polynomials[n].get();
+    }
+
+    // analyze without the memo; empty coefficients mean "not a polynomial".
+    Polynomial analyzeNode(Lowering& lowering, int n) {
+        const Node& node = lowering.nodes[n];
+        const Polynomial none{false, 0, {}};
+        if (node.token.type == TokenType::NUMBER) {
+            return Polynomial{false, 0, {node.token.number}};
+        }
+        if (node.token.type == TokenType::IDENTIFIER) {
+            return Polynomial{true, column(lowering, node), {0.0, 1.0}};
+        }
+        auto operand = [&](int child) {
+            const Polynomial* polynomial = analyze(lowering, child);
+            return polynomial ? *polynomial : Polynomial{true, lower(lowering, child), {0.0, 1.0}};
+        };
+        Polynomial a = operand(node.left);
+        const std::string& op = node.token.value;
+        if (op == "~") {
+            for (double& coefficient : a.coefficients) coefficient = -coefficient;
+            return a;
+        }
+        Polynomial b = operand(node.right);
+        if (!a.hasVariable && !b.hasVariable) {
+            return Polynomial{false, 0, {DoubleArithmetic().apply(a.coefficients[0], b.coefficients[0], op)}};
+        }
+        if (a.hasVariable && b.hasVariable && a.variable != b.variable) {
+            return none;  // Two different variables.
+        }
+        // A term of x that ends up with coefficient 0 cannot simply be
+        // dropped: "x * 0" and "x - x" are NaN, not 0, for infinite x. Such
+        // subtrees keep their written form. Constant terms may cancel.
+        auto isZero = [](const Polynomial& p) { return !p.hasVariable && p.coefficients[0] == 0.0; };
+        Polynomial result{true, a.hasVariable ? a.variable : b.variable, {}};
+        if (op == "+" || op == "-") {
+            result.coefficients.resize(std::max(a.coefficients.size(), b.coefficients.size()), 0.0);
+            for (size_t k = 0; k < a.coefficients.size(); ++k) result.coefficients[k] += a.coefficients[k];
+            for (size_t k = 0; k < b.coefficients.size(); ++k) {
+                result.coefficients[k] += op == "+" ? b.coefficients[k] : -b.coefficients[k];
+            }
+            for (size_t k = 1; k < result.coefficients.size(); ++k) {
+                bool hasTerm = (k < a.coefficients.size() && a.coefficients[k] != 0.0) ||
+                               (k < b.coefficients.size() && b.coefficients[k] != 0.0);
+                if (hasTerm && result.coefficients[k] == 0.0) return none;
+            }
+        } else if (op == "*") {
+            if (isZero(a) || isZero(b) || !multiply(a.coefficients, b.coefficients, result.coefficients)) return none;
+        } else if (op == "/" && !b.hasVariable && dividesByReciprocal(lowering, node.right)) {
+            double reciprocal = 1.0 / b.coefficients[0];
+            if (reciprocal == 0.0 || !multiply(a.coefficients, {reciprocal}, result.coefficients)) return none;
+        } else if (op == "^" && !b.hasVariable && b.coefficients[0] >= 0 &&
+                   b.coefficients[0] <= maxPolynomialDegree && b.coefficients[0] == std::trunc(b.coefficients[0])) {
+            result.coefficients = {1.0};
+            for (int k = 0; k < static_cast<int>(b.coefficients[0]); ++k) {
+                std::vector<double> power = std::move(result.coefficients);
+                if (!multiply(power, a.coefficients, result.coefficients)) return none;
+            }
+        } else {
+            return none;  // Division, remainder, comparisons and other powers.
+        }
+        while (result.coefficients.size() > 1 && result.coefficients.back() == 0.0) {
+            result.coefficients.pop_back();
+        }
+        if (result.coefficients.size() > maxPolynomialDegree + 1) {
+            return none;
+        }
+        return result;
+    }
+
+    // Store a * b in product; false if a coefficient of x in the product is 0
+    // although some of its terms are not, through cancellation or underflow.
+    static bool multiply(const std::vector<double>& a, const std::vector<double>& b, std::vector<double>& product) {
+        product.assign(a.size() + b.size() - 1, 0.0);
+        std::vector<bool> hasTerm(product.size(), false);
+        for (size_t i = 0; i < a.size(); ++i) {
+            for (size_t j = 0; j < b.size(); ++j) {
+                product[i + j] += a[i] * b[j];
+                hasTerm[i + j] = hasTerm[i + j] || (a[i] != 0.0 && b[j] != 0.0);
+            }
+        }
+        for (size_t k = 1; k < product.size(); ++k) {
+            if (hasTerm[k] && product[k] == 0.0) return false;
+        }
+        return true;
+    }
+
+    // c1 * x + c0, skipping a multiplication by 1 or 0 and an addition of 0.
+    uint32_t linear(double c1, uint32_t x, double c0) {
+        if (c1 == 0.0) return constant(c0);
+        if (c1 == 1.0) return c0 == 0.0 ? x : binary("+", x, constant(c0));
+        return c0 == 0.0 ? binary("*", constant(c1), x) : multiplyAdd(constant(c1), x, constant(c0));
+    }
+
+    // c[0] + x * (c[1] + x * (c[2] + ...)), evaluated from the inside out.
+    uint32_t horner(const std::vector<double>& c, uint32_t x) {
+        size_t k = c.size() - 2;
+        uint32_t result = linear(c[k + 1], x, c[k]);
+        while (k-- > 0) {
+            result = c[k] == 0.0 ? binary("*", result, x) : multiplyAdd(result, x, constant(c[k]));
+        }
+        return result;
+    }
+
+    // Coefficients c[begin, end) as low + high * x^half, recursively, so the
+    // two halves are independent. Powers x^2, x^4, ... are shared through
+    // intern.
+    uint32_t estrin(const std::vector<double>& c, size_t begin, size_t end, uint32_t x) {
+        if (end - begin == 1) return constant(c[begin]);
+        if (end - begin == 2) return linear(c[begin + 1], x, c[begin]);
+        size_t half = 1;
+        uint32_t power = x;
+        while (half * 2 < end - begin) {
+            half *= 2;
+            power = binary("*", power, power);
+        }
+        bool unitHigh = end - begin - half == 1 && c[begin + half] == 1.0;
+        bool zeroLow = std::all_of(c.begin() + begin, c.begin() + begin + half, [](double v) { return v == 0.0; });
+        if (zeroLow) return unitHigh ? power : binary("*", estrin(c, begin + half, end, x), power);
+        uint32_t low = estrin(c, begin, begin + half, x);
+        return unitHigh ? binary("+", power, low) : multiplyAdd(estrin(c, begin + half, end, x), power, low);
+    }
+
+    // Give every computed instruction a block buffer, reusing a buffer once
+    // the last instruction reading it has run. Formula results and the filter
+    // stay live to the end of the block, where they are read.
+    void allocateSlots() {
+        const uint32_t forever = std::numeric_limits<uint32_t>::max();
+        std::vector<uint32_t> lastUse(instructions.size(), 0);
+        for (uint32_t k = 0; k < instructions.size(); ++k) {
+            const Instruction& instruction = instructions[k];
+            if (instruction.kind != Instruction::CONSTANT && instruction.kind != Instruction::COLUMN) {
+                lastUse[instruction.left] = k;
+            }
+            if (instruction.kind == Instruction::BINARY || instruction.kind == Instruction::MULTIPLY_ADD) {
+                lastUse[instruction.right] = k;
+            }
+            if (instruction.kind == Instruction::MULTIPLY_ADD) {
+                lastUse[instruction.addend] = k;
+            }
+        }
+        for (uint32_t root : roots) lastUse[root] = forever;
+        if (filterEnd > 0) lastUse[filterRoot] = forever;
+
+        std::vector<uint32_t> freeSlots;
+        for (uint32_t k = 0; k < instructions.size(); ++k) {
+            Instruction& instruction = instructions[k];
+            if (instruction.kind == Instruction::COLUMN) continue;
+            // Operands that end here can hand their buffer to the result.
+            size_t operands = instruction.kind == Instruction::MULTIPLY_ADD ? 3
+                            : instruction.kind == Instruction::BINARY ? 2
+                            : instruction.kind == Instruction::NEGATE ? 1 : 0;
+            const uint32_t reads[3] = {instruction.left, instruction.right, instruction.addend};
+            for (size_t r = 0; r < operands; ++r) {
+                uint32_t operand = reads[r];
+                if (lastUse[operand] == k && instructions[operand].kind != Instruction::COLUMN) {
+                    freeSlots.push_back(instructions[operand].slot);
+                    lastUse[operand] = 0;  // Avoid freeing twice for x op x.
+                }
+            }
+            if (freeSlots.empty()) {
+                instruction.slot = static_cast<uint32_t>(slots++);
+            } else {
+                instruction.slot = freeSlots.back();
+                freeSlots.pop_back();
+            }
+        }
+    }
+
+    std::vector<Instruction> instructions;           // In dependency order.
+    std::unordered_map<std::string, uint32_t> known;  // Instruction ids by structure, for sharing.
+    std::vector<uint32_t> roots;                     // Result instruction of each formula.
+    uint32_t filterRoot = 0;                         // Result instruction of the filter.
+    size_t filterEnd = 0;                            // Instructions before this compute the filter.
+    size_t slots = 0;                                // Number of block buffers needed.
+    size_t polynomials = 0;                          // Polynomials rewritten.
+    ColumnarOptions options;
+};
+
+// CellSheet keeps named cells, each holding a compiled formula that may read
+// other cells ("total = price * qty"). Dependencies are taken from the names
+// left in a formula after inlining, and a name that has no cell yet gets an
+// empty one, so cells can be entered in any order. Changing a cell recomputes
+// only the cells downstream of it, in topological order: Kahn's algorithm
+// splits them into levels whose cells do not depend on each other, and wide
+// levels are spread over threads. A formula that would close a cycle is
+// rejected and the cell keeps its old formula, so the graph stays acyclic.
+// Cells use real (double) arithmetic.
+class CellSheet {
+public:
+    static constexpr size_t parallelLevelSize = 64;  // Smaller levels run on one thread.
+
+    explicit CellSheet(const FunctionLibrary& functions) : functions(functions) {}
+
+    // Give cell name a new formula and recompute what depends on it. Returns
+    // the recomputed cells in the order they were computed. Throws a
+    // runtime_error, leaving the sheet unchanged, if the formula is invalid
+    // or creates a cycle.
+    std::vector<size_t> set(const std::string& name, const std::string& formula) {
+        std::vector<std::string> names;
+        std::queue<Token> rpn = compile(formula, names);
+
+        // Check for a cycle before creating any cell, so that a rejected
+        // formula leaves no placeholder cells behind. A cell that does not
+        // exist yet reads nothing, so only existing cells can close a cycle;
+        // a new cell gets the next free id.
+        auto existing = ids.find(name);
+        size_t newId = existing != ids.end() ? existing->second : cells.size();
+        std::vector<size_t> known;
+        for (const auto& dependency : names) {
+            auto it = ids.find(dependency);
+            if (dependency == name) known.push_back(newId);
+            else if (it != ids.end()) known.push_back(it->second);
+        }
+        checkCycle(newId, name, known);
+
+        size_t id = cellId(name);
+        std::vector<size_t> dependencies;
+        for (const auto& dependency : names) {
+            dependencies.push_back(cellId(dependency));
+        }
+        std::sort(dependencies.begin(), dependencies.end());
+        dependencies.erase(std::unique(dependencies.begin(), dependencies.end()), dependencies.end());
+
+        Cell& cell = cells[id];
+        for (size_t old : cell.dependencies) {
+            auto& readers = cells[old].dependents;
+            readers.erase(std::find(readers.begin(), readers.end(), id));
+        }
+        for (size_t dependency : dependencies) {
+            cells[dependency].dependents.push_back(id);
+        }
+        cell.formula = formula;
+        cell.rpn = std::move(rpn);
+        cell.dependencies = std::move(dependencies);
+        return recompute(id);
+    }
+
+    // Evaluate an expression over the current cell values.
+    std::string evaluate(const std::string& expression) const {
+        try {
+            std::vector<std::string> names;
+            std::queue<Token> rpn = compile(expression, names);
+            std::unordered_map<std::string, double> variables;
+            for (const auto& name : names) {
+                auto it = ids.find(name);
+                if (it == ids.end() || !cells[it->second].error.empty()) {
+                    throw std::runtime_error("Error: Cell '" + name + "' has no value");
+                }
+                variables[name] = cells[it->second].value;
+            }
+            RefinedEvaluator<DoubleArithmetic> evaluator;
+            return evaluator.format(evaluator.evaluate(rpn, nullptr, &variables));
+        } catch (const std::runtime_error& e) {
+            return e.what();
+        }
+    }
+
+    size_t size() const { return cells.size(); }
+
+    // "name = value", or "name: error" for a cell without a value.
+    std::string describe(size_t id) const {
+        const Cell& cell = cells[id];
+        if (!cell.error.empty()) return cell.name + ": " + cell.error;
+        return cell.name + " = " + DoubleArithmetic().format(cell.value);
+    }
+
+private:
+    struct Cell {
+        std::string name;
+        std::string formula;               // Empty while the cell is only referenced.
+        std::queue<Token> rpn;
+        std::vector<size_t> dependencies;  // Cells this one reads, sorted.
+        std::vector<size_t> dependents;    // Cells that read this one.
+        double value = 0.0;
+        std::string error;                 // Set when the cell has no value.
+    };
+
+    size_t cellId(const std::string& name) {
+        auto it = ids.find(name);
+        if (it != ids.end()) return it->second;
+        cells.push_back(Cell{name, "", {}, {}, {}, 0.0, "Error: Cell '" + name + "' is empty"});
+        ids.emplace(name, cells.size() - 1);
+        return cells.size() - 1;
+    }
+
+    // Parse a formula; names not used as calls are cell references, returned in names.
+    std::queue<Token> compile(const std::string& formula, std::vector<std::string>& names) const {
+        EnhancedTokenizer tokenizer;
+        ImprovedParser parser;
+        std::vector<Token> tokens = tokenizer.tokenize(formula);
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            if (tokens[i].type == TokenType::IDENTIFIER && (i + 1 == tokens.size() || tokens[i + 1].value != "(")) {
+                names.push_back(tokens[i].value);
+            }
+        }
+        std::queue<Token> rpn;
+        if (!tokens.empty() && !(tokens.size() == 1 && tokens.front().type == TokenType::INVALID)) {
+            rpn = parser.parse(functions.inlineCalls(tokens, &names));
+        }
+        if (rpn.empty()) {
+            throw std::runtime_error("Error: Invalid formula '" + formula + "'");
+        }
+        // Parameters inside inlined functions are gone; keep the names still read.
+        std::vector<std::string> read;
+        for (std::queue<Token> rest = rpn; !rest.empty(); rest.pop()) {
+            if (rest.front().type == TokenType::IDENTIFIER) read.push_back(rest.front().value);
+        }
+        names = std::move(read);
+        return rpn;
+    }
+
+    // Throw if cell id, called name, would reach itself through the given
+    // dependencies. id may be cells.size() for a cell not created yet.
+    void checkCycle(size_t id, const std::string& name, const std::vector<size_t>& dependencies) const {
+        const size_t unvisited = cells.size() + 1;
+        std::vector<size_t> parent(cells.size() + 1, unvisited);
+        std::vector<size_t> stack;
+        for (size_t dependency : dependencies) {
+            if (parent[dependency] == unvisited) {
+                parent[dependency] = id;
+                stack.push_back(dependency);
+            }
+        }
+        while (!stack.empty()) {
+            size_t current = stack.back();
+            stack.pop_back();
+            if (current == id) {
+                // Walk the parents back to id to name the cells on the cycle.
+                std::string path = name;
+                for (size_t step = parent[id]; step != id; step = parent[step]) {
+                    path = cells[step].name + " -> " + path;
+                }
+                throw std::runtime_error("Error: Cycle " + name + " -> " + path);
+            }
+            for (size_t next : cells[current].dependencies) {
+                if (parent[next] == unvisited) {
+                    parent[next] = current;
+                    stack.push_back(next);
+                }
+            }
+        }
+    }
+
+    // Recompute cell id and everything downstream, level by level.
+    std::vector<size_t> recompute(size_t id) {
+        // Mark the dirty cells: id and all its transitive dependents.
+        std::vector<char> dirty(cells.size(), 0);
+        std::vector<size_t> order{id};
+        dirty[id] = 1;
+        for (size_t i = 0; i < order.size(); ++i) {
+            for (size_t next : cells[order[i]].dependents) {
+                if (!dirty[next]) {
+                    dirty[next] = 1;
+                    order.push_back(next);
+                }
+            }
+        }
+        // A dirty cell is ready once all of its dirty dependencies are done.
+        std::vector<size_t> pending(cells.size(), 0);
+        for (size_t cell : order) {
+            for (size_t dependency : cells[cell].dependencies) {
+                pending[cell] += dirty[dependency];
+            }
+        }
+
+        std::vector<size_t> computed;
+        std::vector<size_t> level{id};
+        while (!level.empty()) {
+            recomputeLevel(level);
+            std::vector<size_t> next;
+            for (size_t cell : level) {
+                computed.push_back(cell);
+                for (size_t dependent : cells[cell].dependents) {
+                    if (--pending[dependent] == 0) next.push_back(dependent);
+                }
+            }
+            level = std::move(next);
+        }
+        return computed;
+    }
+
+    // The cells of a level only read cells of earlier levels, so they can be
+    // computed concurrently; each thread writes only the cells it takes.
+    void recomputeLevel(const std::vector<size_t>& level) {
+        unsigned threads = std::min<size_t>(std::thread::hardware_concurrency(), level.size() / parallelLevelSize);
+        if (threads <= 1) {
+            for (size_t cell : level) recomputeCell(cell);
+            return;
+        }
+        std::atomic<size_t> next{0};
+        auto work = [&]() {
+            for (size_t i = next++; i < level.size(); i = next++) recomputeCell(level[i]);
+        };
+        std::vector<std::thread> workers;
+        for (unsigned t = 1; t < threads; ++t) workers.emplace_back(work);
+        work();
+        for (auto& worker : workers) worker.join();
+    }
+
+    void recomputeCell(size_t id) {
+        Cell& cell = cells[id];
+        cell.error.clear();
+        if (cell.formula.empty()) {
+            cell.error = "Error: Cell '" + cell.name + "' is empty";
+            return;
+        }
+        std::unordered_map<std::string, double> variables;
+        for (size_t dependency : cell.dependencies) {
+            if (!cells[dependency].error.empty()) {
+                cell.error = "Error: Depends on '" + cells[dependency].name + "', which has no value";
+                return;
+            }
+            variables[cells[dependency].name] = cells[dependency].value;
+        }
+        try {
+            cell.value = RefinedEvaluator<DoubleArithmetic>().evaluate(cell.rpn, nullptr, &variables);
+        } catch (const std::runtime_error& e) {
+            cell.error = e.what();
+        }
+    }
+
+    const FunctionLibrary& functions;
+    std::vector<Cell> cells;
+    std::unordered_map<std::string, size_t> ids;  // Cell index by name.
+};
+
+// Function declarations for menu options.
+void printMenu();
+int readMenuOption();
+void handleExpression(CalculatorHistory& history, FunctionLibrary& functions, EnhancedTokenizer& tokenizer, ImprovedParser& parser, const CalculatorSettings& settings);
+void showHistory(const CalculatorHistory& history, const FunctionLibrary& functions);
+void showUserManual();
+void selectMode(CalculatorSettings& settings);
+void searchHistory(const CalculatorHistory& history);
+void exportHistory(const CalculatorHistory& history);
+void showStatistics();
+
+// Function to display the main menu.
+void printMenu() {
+    std::cout << "\n--------------------------------------------------------------------------------\n";
+    std::cout << "C++ Arithmetic Expression Evaluator\n";
+    std::cout << "--------------------------------------------------------------------------------\n\n";
+    std::cout << "1 - Enter Expression\n";
+    std::cout << "2 - History\n";
+    std::cout << "3 - User Manual\n";
+    std::cout << "4 - Numeric Mode\n";
+    std::cout << "5 - Search History\n";
+    std::cout << "6 - Export History\n";
+    std::cout << "7 - Statistics\n";
+    std::cout << "0 - Quit\n";
+    std::cout << "\n--------------------------------------------------------------------------------\n";
+    std::cout << "\nSelect an option: ";
+}
+
+// Read a menu selection. Quit keeps the key 0 (or q) however many options are
+// added, and the end of input quits too. Anything that is not a number gives -1.
+int readMenuOption() {
+    std::string line;
+    if (!std::getline(std::cin, line)) {
+        return 0;
+    }
+    std::string word;
+    std::istringstream(line) >> word;
+    if (word == "q" || word == "Q") {
+        return 0;
+    }
+    int option;
+    if (!(std::istringstream(word) >> option)) {
+        return -1;
+    }
+    return option;
+}
+
+// Function to handle the "Enter Expression" option.
+void handleExpression(CalculatorHistory& history, FunctionLibrary& functions, EnhancedTokenizer& tokenizer, ImprovedParser& parser, const CalculatorSettings& settings) {
+    std::string expression;
+    std::cout << "\n--------------------------------------------------------------------------------\n";
+    std::cout << "\nEnter an arithmetic expression: ";
+    std::getline(std::cin, expression);
+
+    double value;
+    std::string result = evaluateExpression(expression, functions, tokenizer, parser, settings, nullptr, nullptr, &value);
+
+    std::cout << "\nResult: " << result << "\n";
+    history.addEntry(expression, result, value, settings);  // Add expression and result to history
+}
+
+// Function to display the history of calculations and the defined functions.
+void showHistory(const CalculatorHistory& history, const FunctionLibrary& functions) {
+    history.showHistory();
+    functions.showFunctions();
+}
+
+// Function to handle the "Numeric Mode" option.
+void selectMode(CalculatorSettings& settings) {
+    std::cout << "\n--------------------------------------------------------------------------------\n";
+    std::cout << "\n1 - Real (floating point)\n";
+    std::cout << "2 - Integer (exact 64-bit, falls back to real on overflow)\n";
+    std::cout << "3 - Modular (whole numbers modulo a modulus)\n";
+    std::cout << "4 - Rational (exact fractions)\n";
+    std::cout << "5 - Big Integer (whole numbers of any size)\n";
+    std::cout << "6 - Interval (guaranteed error bounds)\n";
+    std::cout << "\nSelect a mode: ";
+
+    std::string choice;
+    std::getline(std::cin, choice);
+    if (choice == "1") {
+        settings.mode = NumericMode::REAL;
+        std::cout << "\nMode set to Real.\n";
+    } else if (choice == "2") {
+        settings.mode = NumericMode::INTEGER;
+        std::cout << "\nMode set to Integer.\n";
+    } else if (choice == "3") {
+        std::cout << "\nEnter the modulus (2 to 18446744073709551615): ";
+        std::string text;
+        std::getline(std::cin, text);
+        errno = 0;
+        char* end = nullptr;
+        unsigned long long modulus = std::strtoull(text.c_str(), &end, 10);
+        if (text.empty() || text[0] == '-' || *end != '\0' || errno == ERANGE || modulus < 2) {
+            std::cout << "\nInvalid modulus. The mode was not changed.\n";
+            return;
+        }
+        settings.mode = NumericMode::MODULAR;
+        settings.modulus = modulus;
+        std::cout << "\nMode set to Modular (mod " << modulus << ").\n";
+    } else if (choice == "4") {
+        settings.mode = NumericMode::RATIONAL;
+        std::cout << "\nMode set to Rational.\n";
+    } else if (choice == "5") {
+        settings.mode = NumericMode::BIG_INTEGER;
+        std::cout << "\nMode set to Big Integer.\n";
+    } else if (choice == "6") {
+        settings.mode = NumericMode::INTERVAL;
+        std::cout << "\nMode set to Interval.\n";
+    } else {
+        std::cout << "\nInvalid mode. The mode was not changed.\n";
+    }
+}
+
+// Function to handle the "Search History" option.
+void searchHistory(const CalculatorHistory& history) {
+    std::cout << "\n--------------------------------------------------------------------------------\n";
+    std::cout << "\n1 - Expressions or results containing the text\n";
+    std::cout << "2 - Expressions starting with the text\n";
+    std::cout << "\nSelect a search: ";
+    std::string choice;
+    std::getline(std::cin, choice);
+    if (choice != "1" && choice != "2") {
+        std::cout << "\nInvalid search.\n";
+        return;
+    }
+
+    std::cout << "\nEnter the text to search for: ";
+    std::string text;
+    std::getline(std::cin, text);
+    history.showSearch(text, choice == "2");
+}
+
+// Function to handle the "Export History" option.
+void exportHistory(const CalculatorHistory& history) {
+    std::cout << "\n--------------------------------------------------------------------------------\n";
+    std::cout << "\nEnter the file to export to: ";
+    std::string path;
+    std::getline(std::cin, path);
+    try {
+        history.exportColumnar(path);
+        std::cout << "\nHistory exported to '" << path << "'.\n";
+    } catch (const std::runtime_error& e) {
+        std::cout << "\n" << e.what() << "\n";
+    }
+}
+
+// Function to handle the "Statistics" option.
+void showStatistics() {
+    std::cout << "\n--------------------------------------------------------------------------------\n";
+    std::cout << "\nStatistics:\n";
+    std::ostringstream memo;
+    printMemoStatistics(memo);
+    std::cout << (memo.str().empty() ? "No subexpressions have been memoized yet (start with --memo).\n" : memo.str());
+    if (AllocationTracker::enabled) {
+        printAllocationStatistics(std::cout);
+    } else {
+        std::cout << "Allocation counts need a build with -DCALCULATOR_TRACK_ALLOCATIONS=1.\n";
+    }
+}
+
+// Function to display the user manual.
+void showUserManual() {
+    std::cout << "\nUser Manual:\n";
+    std::cout << "--------------------------------------------------------------------------------\n";
+    std::cout << "\nWelcome to the C++ Arithmetic Expression Evaluator.\n";
+    std::cout << "This program allows you to evaluate arithmetic expressions involving\n";
+    std::cout << "basic operators such as +, -, *, /, %, and ^ (exponentiation).\n\n";
+    
+    std::cout << "Menu Options:\n";
+    std::cout << "1 - Enter Expression: Allows you to input an arithmetic expression.\n";
+    std::cout << "2 - History: Displays the history of evaluated expressions and their results.\n";
+    std::cout << "3 - User Manual: Shows this user manual.\n";
+    std::cout << "4 - Numeric Mode: Chooses how numbers are represented.\n";
+    std::cout << "5 - Search History: Finds past expressions by text.\n";
+    std::cout << "6 - Export History: Saves the history to a columnar binary file.\n";
+    std::cout << "7 - Statistics: Shows cache reuse and, in instrumented builds, allocations.\n";
+    std::cout << "0 - Quit: Exits the program (q also works).\n\n";
+
+    std::cout << "Entering Expressions:\n";
+    std::cout << "Enter any arithmetic expression using numbers and operators.\n";
+    std::cout << "For example: '3 + 4 * 2', '2 ^ 3', '(4 + 5) / 2'.\n";
+    std::cout << "The program supports parentheses for grouping.\n";
+    std::cout << "Numbers may use scientific notation ('1e10', '2.5e-3'), hexadecimal\n";
+    std::cout << "('0xFF', '0x1.8p3') and '_' between digits ('1_000_000'). Whole hex\n";
+    std::cout << "numbers such as '0xFF' work in every mode.\n";
+    std::cout << "Comparisons <, >, <=, >=, == and != give 1 or 0 and bind loosest,\n";
+    std::cout << "so '1 + 2 > 2' is 1.\n\n";
+
+    std::cout << "User-Defined Functions:\n";
+    std::cout << "Define a function with 'def name(params) = expression', for example\n";
+    std::cout << "'def area(w, h) = w * h', then call it as 'area(3, 4) + 1'.\n";
+    std::cout << "A function may call functions defined before it, but not itself.\n";
+    std::cout << "Functions last until the program ends.\n\n";
+
+    std::cout << "Numeric Modes:\n";
+    std::cout << "Real: all numbers are floating point (the default).\n";
+    std::cout << "Integer: whole numbers are computed exactly with 64-bit integers.\n";
+    std::cout << "A result that overflows or is not a whole number (e.g. 7 / 2)\n";
+    std::cout << "is computed in floating point instead.\n";
+    std::cout << "Modular: every result is reduced modulo the chosen modulus, and\n";
+    std::cout << "'/' multiplies by the modular inverse. Exponents are not reduced:\n";
+    std::cout << "they are evaluated as whole numbers from 0 to 2^63 - 1, so\n";
+    std::cout << "'2 ^ 7' modulo 5 is 3 and '3 ^ 1000000 * 2' is computed exactly.\n";
+    std::cout << "Rational: results are exact fractions, e.g. '1/3 + 1/6' gives 1/2.\n";
+    std::cout << "Numerators and denominators grow past 64 bits as needed, and '^'\n";
+    std::cout << "is exact for whole exponents; a fractional exponent gives a\n";
+    std::cout << "floating point result.\n";
+    std::cout << "Big Integer: whole numbers of any size, e.g. '2 ^ 4096'. '/' drops\n";
+    std::cout << "the fractional part and '%' keeps the sign of the left operand.\n";
+    std::cout << "Interval: the result is shown as [lower, upper], a range that is\n";
+    std::cout << "guaranteed to contain the exact answer despite rounding.\n\n";
+
+    std::cout << "History:\n";
+    std::cout << "After evaluating expressions, you can view their history\n";
+    std::cout << "along with the results by selecting the 'History' option.\n";
+    std::cout << "'Search History' lists the entries whose expression or result\n";
+    std::cout << "contains some text, or whose expression starts with it.\n";
+    std::cout << "'Export History' writes the history to a binary file with one\n";
+    std::cout << "column each for expression ids, numeric results, error codes,\n";
+    std::cout << "timestamps and numeric modes, plus a dictionary of the distinct\n";
+    std::cout << "expressions. Results are stored as evaluated, not as displayed.\n";
+    std::cout << "\n--------------------------------------------------------------------------------\n";
+}
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+// Coroutine interface for services that must not block their executor thread.
+// "co_await evaluateAsync(expression, functions, settings)" returns the same
+// text evaluateExpression would. Expressions whose estimated cost is below
+// poolCostThreshold are evaluated inline without suspending; costlier ones run
+// on a background pool and the coroutine resumes on that pool's thread. Coroutines
+// need C++20 (-std=c++20); in a C++17 build this interface is left out and
+// "--self-test" reports its checks as skipped.
+
+// Fixed set of background threads shared by all asynchronous evaluations.
+class AsyncEvaluationPool {
+public:
+    static AsyncEvaluationPool& instance() {
+        static AsyncEvaluationPool pool;
+        return pool;
+    }
+
+    void post(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(std::move(job));
+        }
+        ready.notify_one();
+    }
+
+    ~AsyncEvaluationPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        ready.notify_all();
+        for (auto& thread : threads) thread.join();
+    }
+
+private:
+    AsyncEvaluationPool() {
+        unsigned count = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned i = 0; i < count; ++i) {
+            threads.emplace_back([this] { run(); });
+        }
+    }
+
+    void run() {
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (jobs.empty()) return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<std::function<void()>> jobs;
+    bool stopping = false;
+    std::vector<std::thread> threads;
+};
+
+// Awaitable returned by evaluateAsync.
+class EvaluationAwaitable {
+public:
+    static constexpr size_t poolCostThreshold = 1024;  // Estimated cost below which we stay inline.
+
+    EvaluationAwaitable(std::string expression, FunctionLibrary functions, CalculatorSettings settings,
+                        CancellationToken cancellation)
+        : expression(std::move(expression)), functions(std::move(functions)), settings(settings),
+          cancellation(std::move(cancellation)) {}
+
+    bool await_ready() {
+        if (estimateCost(expression, functions, settings) >= poolCostThreshold) {
+            return false;
+        }
+        result = run();
+        return true;
+    }
+
+    // Rough cost of evaluating expression once its calls are inlined: one unit
+    // per token, and more for "^", which is a pow call in real mode and a
+    // series of multiplications of growing numbers in rational and big integer
+    // modes. Definitions and expressions that fail to tokenize cost nothing,
+    // since their result is ready at once.
+    static size_t estimateCost(const std::string& expression, const FunctionLibrary& functions,
+                               const CalculatorSettings& settings) {
+        if (FunctionLibrary::isDefinition(expression)) return 0;
+        std::vector<Token> tokens;
+        try {
+            EnhancedTokenizer tokenizer;
+            tokens = functions.inlineCalls(tokenizer.tokenize(expression));
+        } catch (const std::runtime_error&) {
+            return 0;
+        }
+        bool bigNumbers = settings.mode == NumericMode::RATIONAL || settings.mode == NumericMode::BIG_INTEGER;
+        size_t powerCost = bigNumbers ? 256 : 8;
+        size_t cost = 0;
+        for (const Token& token : tokens) {
+            cost += token.type == TokenType::OPERATOR && token.value == "^" ? powerCost : 1;
+        }
+        return cost;
+    }
+
+    void await_suspend(std::coroutine_handle<> caller) {
+        AsyncEvaluationPool::instance().post([this, caller] {
+            result = run();
+            caller.resume();
+        });
+    }
+
+    std::string await_resume() { return std::move(result); }
+
+private:
+    std::string run() {
+        EnhancedTokenizer tokenizer;
+        ImprovedParser parser;
+        return evaluateExpression(expression, functions, tokenizer, parser, settings, nullptr, &cancellation);
+    }
+
+    std::string expression;
+    FunctionLibrary functions;  // A copy, so the caller may keep defining functions.
+    CalculatorSettings settings;
+    CancellationToken cancellation;
+    std::string result;
+};
+
+// Evaluate expression asynchronously; cancel the token to stop an abandoned request.
+EvaluationAwaitable evaluateAsync(std::string expression, const FunctionLibrary& functions,
+                                  const CalculatorSettings& settings,
+                                  CancellationToken cancellation = CancellationToken()) {
+    return EvaluationAwaitable(std::move(expression), functions, settings, std::move(cancellation));
+}
+#endif
+
+#ifdef __linux__
+// Shared-memory transport for clients on the same host. A channel holds two
+// single-producer/single-consumer rings in POSIX shared memory: clients push
+// expressions into requests and the evaluator process pushes results into
+// responses. A waiting side busy-polls briefly and then sleeps on a futex, so
+// a request costs no syscalls while both sides are active.
+
+// One fixed-size message: an expression or a result.
+struct SharedMessage {
+    static constexpr uint32_t shutdown = UINT32_MAX;  // Length that tells the server to stop.
+
+    uint32_t length;
+    char text[508];
+
+    // Payloads that do not fit are rejected rather than cut short.
+    void assign(const std::string& value) {
+        if (value.size() > sizeof(text)) {
+            throw std::runtime_error("Error: Message longer than " + std::to_string(sizeof(text)) + " bytes");
+        }
+        length = static_cast<uint32_t>(value.size());
+        std::memcpy(text, value.data(), length);
+    }
+
+    // Whether length describes a payload; the peer may have written anything.
+    bool fits() const { return length <= sizeof(text); }
+
+    // Store the result of evaluating the payload, or the error that replaces it.
+    void answer(FunctionLibrary& functions, EnhancedTokenizer& tokenizer, ImprovedParser& parser,
+                const CalculatorSettings& settings) {
+        try {
+            if (!fits()) {
+                throw std::runtime_error("Error: Message longer than " + std::to_string(sizeof(text)) + " bytes");
+            }
+            assign(evaluateExpression(std::string(text, length), functions, tokenizer, parser, settings));
+        } catch (const std::exception& e) {
+            assign(e.what());
+        }
+    }
+};
+
+// Lock-free ring with one producer and one consumer, safe across processes.
+class SharedRing {
+public:
+    static constexpr uint32_t capacity = 64;   // Slots; a power of two.
+    static constexpr int spinLimit = 1000;     // Polls before sleeping on the futex.
+
+    void push(const SharedMessage& message) {
+        uint32_t position = tail.load(std::memory_order_relaxed);
+        while (position - head.load(std::memory_order_acquire) == capacity) {
+            sched_yield();  // Full: the consumer is behind.
+        }
+        slots[position % capacity] = message;
+        tail.store(position + 1);  // Sequentially consistent, paired with waiting below.
+        if (waiting.load()) {
+            futex(FUTEX_WAKE, INT32_MAX);
+        }
+    }
+
+    void pop(SharedMessage& message) {
+        // Polling only helps when the producer can run on another core meanwhile.
+        static const int spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? spinLimit : 0;
+        uint32_t position = head.load(std::memory_order_relaxed);
+        for (int spin = 0; tail.load(std::memory_order_acquire) == position; ++spin) {
+            if (spin < spins) {
+#if defined(__x86_64__) || defined(__i386__)
+                __builtin_ia32_pause();
+#endif
+                continue;
+            }
+            waiting.store(1);
+            if (tail.load() == position) {
+                futex(FUTEX_WAIT, position);  // Returns at once if tail has moved.
+            }
+            waiting.store(0);
+        }
+        message = slots[position % capacity];
+        head.store(position + 1, std::memory_order_release);
+    }
+
+private:
+    void futex(int operation, uint32_t value) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&tail), operation, value, nullptr, nullptr, 0);
+    }
+
+    alignas(64) std::atomic<uint32_t> tail{0};     // Written by the producer; also the futex word.
+    alignas(64) std::atomic<uint32_t> head{0};     // Written by the consumer.
+    alignas(64) std::atomic<uint32_t> waiting{0};  // Set while the consumer sleeps.
+    SharedMessage slots[capacity];
+};
+
+// The two rings shared by one client and the evaluator process.
+struct SharedChannel {
+    // "CALCSHM" and a layout version, stored by the server once the rings are
+    // ready; change the version whenever this layout changes.
+    static constexpr uint64_t readyMagic = 0x4d4853434c4143ULL | (uint64_t(1) << 56);
+
+    std::atomic<uint64_t> magic{0};
+    SharedRing requests;
+    SharedRing responses;
+};
+
+// Map the shared memory object called name. With create, a new object is
+// made, and an existing one is an error rather than being reset under the
+// server using it. Otherwise the object must be a ready channel of this
+// layout, checked before any access that could fault on a short object.
+SharedChannel* mapSharedChannel(const std::string& name, bool create) {
+    int fd = shm_open(name.c_str(), create ? O_CREAT | O_EXCL | O_RDWR : O_RDWR, 0600);
+    if (fd < 0 && create && errno == EEXIST) {
+        throw std::runtime_error("Error: Shared memory '" + name + "' is already in use");
+    }
+    if (fd < 0) {
+        throw std::runtime_error("Error: Cannot open shared memory '" + name + "'");
+    }
+    if (create && ftruncate(fd, sizeof(SharedChannel)) != 0) {
+        close(fd);
+        shm_unlink(name.c_str());
+        throw std::runtime_error("Error: Cannot size shared memory '" + name + "'");
+    }
+    struct stat status;
+    if (!create && (fstat(fd, &status) != 0 || static_cast<uint64_t>(status.st_size) < sizeof(SharedChannel))) {
+        close(fd);
+        throw std::runtime_error("Error: Shared memory '" + name + "' is not a calculator channel");
+    }
+    void* memory = mmap(nullptr, sizeof(SharedChannel), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        if (create) shm_unlink(name.c_str());
+        throw std::runtime_error("Error: Cannot map shared memory '" + name + "'");
+    }
+    if (create) {
+        SharedChannel* channel = new (memory) SharedChannel();
+        channel->magic.store(SharedChannel::readyMagic, std::memory_order_release);
+        return channel;
+    }
+    SharedChannel* channel = static_cast<SharedChannel*>(memory);
+    if (channel->magic.load(std::memory_order_acquire) != SharedChannel::readyMagic) {
+        munmap(memory, sizeof(SharedChannel));
+        throw std::runtime_error("Error: Shared memory '" + name + "' is not a calculator channel");
+    }
+    return channel;
+}
+
+// Answer requests on the channel until a client sends the shutdown message.
+void serveChannel(SharedChannel& channel, const CalculatorSettings& settings) {
+    EnhancedTokenizer tokenizer;
+    ImprovedParser parser;
+    FunctionLibrary functions;
+    SharedMessage message;
+    while (true) {
+        channel.requests.pop(message);
+        if (message.length == SharedMessage::shutdown) {
+            break;
+        }
+        message.answer(functions, tokenizer, parser, settings);
+        channel.responses.push(message);
+    }
+}
+
+// Run the evaluator as a shared-memory server ("--serve-shm name").
+int serveSharedMemory(const std::string& name, const CalculatorSettings& settings) {
+    SharedChannel* channel;
+    try {
+        channel = mapSharedChannel(name, true);
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+    std::cout << "Serving on shared memory '" << name << "'.\n";
+    serveChannel(*channel, settings);
+    munmap(channel, sizeof(SharedChannel));
+    shm_unlink(name.c_str());
+    return 0;
+}
+
+// Send each line of standard input to a server ("--shm-client name") and
+// print the results; "quit" stops the server.
+int runSharedMemoryClient(const std::string& name) {
+    SharedChannel* channel;
+    try {
+        channel = mapSharedChannel(name, false);
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+    SharedMessage message;
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        if (line == "quit") {
+            message.length = SharedMessage::shutdown;
+            channel->requests.push(message);
+            break;
+        }
+        try {
+            message.assign(line);
+        } catch (const std::exception& e) {
+            std::cout << e.what() << "\n";
+            continue;
+        }
+        channel->requests.push(message);
+        channel->responses.pop(message);
+        std::cout << std::string(message.text, message.length) << "\n";
+    }
+    munmap(channel, sizeof(SharedChannel));
+    return 0;
+}
+
+// Read or write exactly size bytes on a socket; false on end of stream or error.
+bool readFully(int fd, void* buffer, size_t size) {
+    char* data = static_cast<char*>(buffer);
+    while (size > 0) {
+        ssize_t count = read(fd, data, size);
+        if (count <= 0) return false;
+        data += count;
+        size -= static_cast<size_t>(count);
+    }
+    return true;
+}
+
+bool writeFully(int fd, const void* buffer, size_t size) {
+    const char* data = static_cast<const char*>(buffer);
+    while (size > 0) {
+        ssize_t count = write(fd, data, size);
+        if (count <= 0) return false;
+        data += count;
+        size -= static_cast<size_t>(count);
+    }
+    return true;
+}
+
+// Socket counterpart of serveChannel, used as the baseline in the benchmark.
+void serveSocket(int fd, const CalculatorSettings& settings) {
+    EnhancedTokenizer tokenizer;
+    ImprovedParser parser;
+    FunctionLibrary functions;
+    SharedMessage message;
+    while (readFully(fd, &message.length, sizeof(message.length))) {
+        // An oversize length leaves the stream unframed: answer and hang up.
+        bool framed = message.fits();
+        if (framed && !readFully(fd, message.text, message.length)) break;
+        message.answer(functions, tokenizer, parser, settings);
+        if (!writeFully(fd, &message, sizeof(message.length) + message.length) || !framed) break;
+    }
+}
+#endif
+
+#ifdef __linux__
+// AsyncFileIO queues file reads and writes so they overlap with evaluation. It
+// drives io_uring directly through its system calls when the kernel (or a
+// container's seccomp policy) allows it, and otherwise performs each
+// operation with pread/pwrite at submission time.
+class AsyncFileIO {
+public:
+    AsyncFileIO() {
+#if CALCULATOR_HAVE_IO_URING
+        setupRing();
+#endif
+    }
+
+    ~AsyncFileIO() {
+#if CALCULATOR_HAVE_IO_URING
+        if (ringFd >= 0) {
+            munmap(submissionRing, submissionRingSize);
+            if (completionRing != submissionRing) munmap(completionRing, completionRingSize);
+            munmap(entries, entryCount * sizeof(io_uring_sqe));
+            close(ringFd);
+        }
+#endif
+    }
+
+    AsyncFileIO(const AsyncFileIO&) = delete;
+    AsyncFileIO& operator=(const AsyncFileIO&) = delete;
+
+    bool usingRing() const { return ringFd >= 0; }
+
+    // Queue a read or write; wait(tag) returns its byte count or -errno.
+    void submit(bool write, int fd, char* buffer, size_t size, uint64_t offset, uint64_t tag) {
+#if CALCULATOR_HAVE_IO_URING
+        if (ringFd >= 0) {
+            unsigned tail = *submissionTail;
+            unsigned index = tail & *submissionMask;
+            io_uring_sqe& entry = entries[index];
+            std::memset(&entry, 0, sizeof(entry));
+            entry.opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+            entry.fd = fd;
+            entry.addr = reinterpret_cast<uint64_t>(buffer);
+            entry.len = static_cast<uint32_t>(size);
+            entry.off = offset;
+            entry.user_data = tag;
+            submissionArray[index] = index;
+            __atomic_store_n(submissionTail, tail + 1, __ATOMIC_RELEASE);
+            if (syscall(__NR_io_uring_enter, ringFd, 1, 0, 0, nullptr, 0) >= 0) {
+                inFlight.insert(tag);
+                return;
+            }
+            __atomic_store_n(submissionTail, tail, __ATOMIC_RELEASE);  // Not consumed; run it below.
+        }
+#endif
+        ssize_t count = write ? pwrite(fd, buffer, size, static_cast<off_t>(offset))
+                              : pread(fd, buffer, size, static_cast<off_t>(offset));
+        completed[tag] = count < 0 ? -errno : count;
+    }
+
+    // A tag that was never submitted, or was already collected, fails with
+    // -EINVAL instead of waiting for a completion that cannot arrive.
+    int64_t wait(uint64_t tag) {
+        while (completed.find(tag) == completed.end()) {
+            if (inFlight.find(tag) == inFlight.end()) {
+                return -EINVAL;
+            }
+#if CALCULATOR_HAVE_IO_URING
+            reapCompletions();
+#endif
+        }
+        int64_t result = completed[tag];
+        completed.erase(tag);
+        return result;
+    }
+
+private:
+#if CALCULATOR_HAVE_IO_URING
+    void setupRing() {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        int fd = static_cast<int>(syscall(__NR_io_uring_setup, 8, &params));
+        if (fd < 0) return;
+
+        submissionRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        completionRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single) submissionRingSize = completionRingSize = std::max(submissionRingSize, completionRingSize);
+
+        void* sq = mmap(nullptr, submissionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        void* cq = single ? sq : mmap(nullptr, completionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        void* sqes = mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+            close(fd);
+            return;
+        }
+
+        char* sqBase = static_cast<char*>(sq);
+        char* cqBase = static_cast<char*>(cq);
+        submissionRing = sq;
+        completionRing = cq;
+        submissionTail = reinterpret_cast<unsigned*>(sqBase + params.sq_off.tail);
+        submissionMask = reinterpret_cast<unsigned*>(sqBase + params.sq_off.ring_mask);
+        submissionArray = reinterpret_cast<unsigned*>(sqBase + params.sq_off.array);
+        completionHead = reinterpret_cast<unsigned*>(cqBase + params.cq_off.head);
+        completionTail = reinterpret_cast<unsigned*>(cqBase + params.cq_off.tail);
+        completionMask = reinterpret_cast<unsigned*>(cqBase + params.cq_off.ring_mask);
+        completions = reinterpret_cast<io_uring_cqe*>(cqBase + params.cq_off.cqes);
+        entries = static_cast<io_uring_sqe*>(sqes);
+        entryCount = params.sq_entries;
+        ringFd = fd;
+    }
+
+    // Block until at least one operation completes and record the results.
+    void reapCompletions() {
+        unsigned head = *completionHead;
+        if (head == __atomic_load_n(completionTail, __ATOMIC_ACQUIRE)) {
+            syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        }
+        unsigned tail = __atomic_load_n(completionTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            const io_uring_cqe& completion = completions[head & *completionMask];
+            completed[completion.user_data] = completion.res;
+            inFlight.erase(completion.user_data);
+        }
+        __atomic_store_n(completionHead, head, __ATOMIC_RELEASE);
+    }
+
+    void* submissionRing = nullptr;
+    void* completionRing = nullptr;
+    size_t submissionRingSize = 0, completionRingSize = 0;
+    unsigned *submissionTail = nullptr, *submissionMask = nullptr, *submissionArray = nullptr;
+    unsigned *completionHead = nullptr, *completionTail = nullptr, *completionMask = nullptr;
+    io_uring_cqe* completions = nullptr;
+    io_uring_sqe* entries = nullptr;
+    unsigned entryCount = 0;
+#endif
+    int ringFd = -1;
+    std::map<uint64_t, int64_t> completed;  // Results by tag, until wait() collects them.
+    std::set<uint64_t> inFlight;            // Tags submitted to the ring and not yet reaped.
+};
+
+// A NUMA node and the CPUs that belong to it.
+struct NumaNode {
+    int id;
+    std::vector<int> cpus;
+};
+
+// Parse a sysfs CPU list such as "0-3,8-11".
+std::vector<int> parseCpuList(const std::string& text) {
+    std::vector<int> cpus;
+    std::istringstream iss(text);
+    std::string range;
+    while (std::getline(iss, range, ',')) {
+        size_t dash = range.find('-');
+        try {
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+        } catch (const std::exception&) {
+            // Ignore malformed entries.
+        }
+    }
+    return cpus;
+}
+
+// Read the NUMA layout from sysfs, limited to the CPUs this process may use.
+// Without sysfs (or on a single node) everything is one node.
+std::vector<NumaNode> readNumaTopology() {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    bool haveMask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+    auto usable = [&](int cpu) { return !haveMask || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)); };
+
+    std::vector<NumaNode> nodes;
+    for (int id = 0; id < 1024; ++id) {  // Node ids may have gaps.
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+        if (!file) continue;
+        std::string text;
+        std::getline(file, text);
+        NumaNode node{id, {}};
+        for (int cpu : parseCpuList(text)) {
+            if (usable(cpu)) node.cpus.push_back(cpu);
+        }
+        if (!node.cpus.empty()) nodes.push_back(node);
+    }
+    if (nodes.empty()) {
+        NumaNode node{0, {}};
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (haveMask && CPU_ISSET(cpu, &allowed)) node.cpus.push_back(cpu);
+        }
+        if (node.cpus.empty()) node.cpus.push_back(-1);  // Unknown: run unpinned.
+        nodes.push_back(node);
+    }
+    return nodes;
+}
+
+// NumaWorkerPool runs one worker thread per usable CPU, pinned to that CPU.
+// Every NUMA node has its own queue and its own ExpressionCache replica. The
+// node's state is allocated by a thread pinned to that node, and cache entries,
+// tokenizers, parsers and result strings are allocated by the node's workers,
+// so their memory is first touched on the node that uses it. The input lines
+// stay where the reader allocated them: work is split into one contiguous
+// shard per node in proportion to the node's CPU count, not by where its
+// input lives.
+class NumaWorkerPool {
+public:
+    explicit NumaWorkerPool(const CalculatorSettings& settings) : settings(settings) {
+        for (const auto& topology : readNumaTopology()) {
+            // Allocate the node's queue and cache from one of its own CPUs.
+            std::thread allocate([&] {
+                pin(topology.cpus.front());
+                nodes.emplace_back(new Node(topology));
+            });
+            allocate.join();
+        }
+        for (auto& node : nodes) {
+            for (int cpu : node->topology.cpus) {
+                threads.emplace_back(&NumaWorkerPool::work, this, node.get(), cpu);
+            }
+        }
+    }
+
+    ~NumaWorkerPool() {
+        for (auto& node : nodes) {
+            std::lock_guard<std::mutex> lock(node->mutex);
+            node->stopping = true;
+            node->ready.notify_all();
+        }
+        for (auto& thread : threads) thread.join();
+    }
+
+    NumaWorkerPool(const NumaWorkerPool&) = delete;
+    NumaWorkerPool& operator=(const NumaWorkerPool&) = delete;
+
+    // Evaluate lines [begin, end) into results and wait until all are done.
+    void evaluate(const std::vector<std::string>& lines, size_t begin, size_t end,
+                  const FunctionLibrary& functions, std::vector<std::string>& results) {
+        if (begin >= end) return;
+        size_t totalCpus = threads.size();
+        size_t position = begin;
+        for (size_t n = 0; n < nodes.size(); ++n) {
+            Node& node = *nodes[n];
+            size_t shard = n + 1 == nodes.size() ? end - position
+                                                  : (end - begin) * node.topology.cpus.size() / totalCpus;
+            // Split the node's shard into a few tasks per worker for load balance.
+            size_t pieces = std::max<size_t>(1, std::min(shard / 256, node.topology.cpus.size() * 4));
+            std::lock_guard<std::mutex> lock(node.mutex);
+            for (size_t piece = 0; piece < pieces && shard > 0; ++piece) {
+                size_t size = (shard + (pieces - piece) - 1) / (pieces - piece);
+                node.tasks.push_back(Task{&lines, position, position + size, &results, &functions});
+                outstanding.fetch_add(1);
+                position += size;
+                shard -= size;
+            }
+            node.ready.notify_all();
+        }
+        std::unique_lock<std::mutex> lock(doneMutex);
+        done.wait(lock, [this] { return outstanding.load() == 0; });
+    }
+
+    // Print expressions evaluated and throughput per node.
+    void report(std::ostream& out) const {
+        for (const auto& node : nodes) {
+            double seconds = node->busyNanoseconds.load() / 1e9;
+            uint64_t count = node->expressions.load();
+            out << "node " << node->topology.id << ": " << node->topology.cpus.size() << " worker(s), "
+                << count << " expressions, "
+                << (seconds > 0 ? count / seconds : 0.0) << " expressions/s per worker\n";
+        }
+    }
+
+private:
+    struct Task {
+        const std::vector<std::string>* lines;
+        size_t begin, end;
+        std::vector<std::string>* results;
+        const FunctionLibrary* functions;
+    };
+
+    struct Node {
+        explicit Node(NumaNode topology) : topology(std::move(topology)) {}
+
+        NumaNode topology;
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::deque<Task> tasks;
+        bool stopping = false;
+        ExpressionCache cache;  // This node's replica.
+        std::atomic<uint64_t> expressions{0};
+        std::atomic<uint64_t> busyNanoseconds{0};
+    };
+
+    // Pin the calling thread to cpu; -1 leaves it unpinned.
+    static void pin(int cpu) {
+        if (cpu >= 0) {
+            cpu_set_t mask;
+            CPU_ZERO(&mask);
+            CPU_SET(cpu, &mask);
+            sched_setaffinity(0, sizeof(mask), &mask);  // Best effort; runs unpinned on failure.
+        }
+    }
+
+    void work(Node* node, int cpu) {
+        pin(cpu);
+        // Created after pinning, so their memory is first touched on this node.
+        EnhancedTokenizer tokenizer;
+        ImprovedParser parser;
+        while (true) {
+            Task task;
+            {
+                std::unique_lock<std::mutex> lock(node->mutex);
+                node->ready.wait(lock, [node] { return node->stopping || !node->tasks.empty(); });
+                if (node->tasks.empty()) return;
+                task = node->tasks.front();
+                node->tasks.pop_front();
+            }
+            auto start = std::chrono::steady_clock::now();
+            FunctionLibrary functions = *task.functions;
+            for (size_t i = task.begin; i < task.end; ++i) {
+                (*task.results)[i] = evaluateExpression((*task.lines)[i], functions, tokenizer, parser, settings, &node->cache);
+            }
+            node->busyNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+            node->expressions += task.end - task.begin;
+            if (outstanding.fetch_sub(1) == 1) {
+                std::lock_guard<std::mutex> lock(doneMutex);
+                done.notify_all();
+            }
+        }
+    }
+
+    CalculatorSettings settings;
+    std::vector<std::unique_ptr<Node>> nodes;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> outstanding{0};  // Tasks queued or running.
+    std::mutex doneMutex;
+    std::condition_variable done;
+};
+
+// Evaluate a file of expressions, one per line, and write one result per line
+// ("--batch input output"). The next input chunk is read and the previous
+// results are written while the current chunk is evaluated. Definitions take
+// effect for the lines after them, as in the interactive mode.
+int runBatch(const std::string& inputPath, const std::string& outputPath, const CalculatorSettings& settings) {
+    const size_t chunkSize = size_t(4) << 20;
+    int input = open(inputPath.c_str(), O_RDONLY);
+    if (input < 0) {
+        std::cerr << "Error: Cannot open '" << inputPath << "'\n";
+        return 1;
+    }
+    int output = open(outputPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output < 0) {
+        std::cerr << "Error: Cannot create '" << outputPath << "'\n";
+        close(input);
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    AsyncFileIO io;
+    NumaWorkerPool pool(settings);
+    EnhancedTokenizer tokenizer;
+    ImprovedParser parser;
+    FunctionLibrary functions;
+
+    std::vector<char> buffers[2] = {std::vector<char>(chunkSize), std::vector<char>(chunkSize)};
+    std::string outputs[2];  // Result text; a buffer is reused only after its write completes.
+    uint64_t writeOffsets[2] = {0, 0};
+    uint64_t writeTags[2] = {0, 0};  // The tag submitted for each buffer's pending write.
+    bool writing[2] = {false, false};
+    uint64_t inputOffset = 0, outputOffset = 0, lineCount = 0;
+    std::string partial;  // An incomplete last line carried into the next chunk.
+    int64_t status = 0;
+
+    // Wait for the write from outputs[index] and finish a short write synchronously.
+    auto finishWrite = [&](int index) {
+        writing[index] = false;
+        int64_t written = io.wait(writeTags[index]);
+        const std::string& text = outputs[index];
+        while (written >= 0 && static_cast<uint64_t>(written) < text.size()) {
+            ssize_t more = pwrite(output, text.data() + written, text.size() - written,
+                                  static_cast<off_t>(writeOffsets[index] + written));
+            written = more <= 0 ? -errno : written + more;
+        }
+        if (written < 0 && status == 0) status = written;
+    };
+
+    // Even tags are reads of chunk tag / 2; odd tags are writes of chunk tag / 2.
+    io.submit(false, input, buffers[0].data(), chunkSize, 0, 0);
+    uint64_t chunk = 0;
+    for (;; ++chunk) {
+        int current = chunk % 2;
+        int64_t count = io.wait(chunk * 2);
+        if (count < 0) {
+            status = count;
+            break;
+        }
+        inputOffset += count;
+        bool last = count == 0;
+        if (!last) {
+            io.submit(false, input, buffers[1 - current].data(), chunkSize, inputOffset, (chunk + 1) * 2);
+        }
+
+        // Split the chunk into complete lines.
+        std::vector<std::string> lines;
+        const char* data = buffers[current].data();
+        const char* end = data + count;
+        for (const char* newline; (newline = static_cast<const char*>(std::memchr(data, '\n', end - data)));) {
+            partial.append(data, newline);
+            lines.push_back(std::move(partial));
+            partial.clear();
+            data = newline + 1;
+        }
+        partial.append(data, end);
+        if (last && !partial.empty()) {
+            lines.push_back(std::move(partial));
+        }
+
+        // Evaluate runs of expressions in parallel, applying definitions in order.
+        std::vector<std::string> results(lines.size());
+        size_t runStart = 0;
+        for (size_t i = 0; i <= lines.size(); ++i) {
+            if (i == lines.size() || FunctionLibrary::isDefinition(lines[i])) {
+                pool.evaluate(lines, runStart, i, functions, results);
+                if (i < lines.size()) {
+                    results[i] = evaluateExpression(lines[i], functions, tokenizer, parser, settings);
+                }
+                runStart = i + 1;
+            }
+        }
+        lineCount += lines.size();
+
+        if (writing[current]) {
+            finishWrite(current);
+        }
+        std::string& text = outputs[current];
+        text.clear();
+        for (const auto& result : results) {
+            text += result;
+            text += '\n';
+        }
+        if (!text.empty()) {
+            io.submit(true, output, &text[0], text.size(), outputOffset, chunk * 2 + 1);
+            writeOffsets[current] = outputOffset;
+            writeTags[current] = chunk * 2 + 1;
+            writing[current] = true;
+            outputOffset += text.size();
+        }
+        if (last || status < 0) {
+            break;
+        }
+    }
+
+    // Collect the writes still in flight, oldest first. A failed read can stop
+    // the loop before an earlier write was collected, so order them by tag.
+    int oldest = writeTags[0] <= writeTags[1] ? 0 : 1;
+    for (int index : {oldest, 1 - oldest}) {
+        if (writing[index]) {
+            finishWrite(index);
+        }
+    }
+    close(input);
+    close(output);
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cerr << lineCount << " expressions, " << inputOffset << " bytes in " << elapsed.count() << " s ("
+              << (elapsed.count() > 0 ? inputOffset / elapsed.count() / 1e6 : 0.0) << " MB/s, "
+              << (io.usingRing() ? "io_uring" : "pread/pwrite") << ")\n";
+    pool.report(std::cerr);
+    printMemoStatistics(std::cerr);
+    printAllocationStatistics(std::cerr);
+    if (status < 0) {
+        std::cerr << "Error: " << std::strerror(static_cast<int>(-status)) << "\n";
+        return 1;
+    }
+    return 0;
+}
+#endif
+
+// HardwareCounters counts CPU events of the calling thread in user space
+// through perf_event_open, for the benchmarks. Each event is opened on its
+// own, so a CPU or hypervisor lacking one (often the cache events) only loses
+// that column. Inside containers, under a strict perf_event_paranoid or on
+// other systems no event opens at all; the benchmarks then report wall-clock
+// time only, with unavailableReason() saying why.
+class HardwareCounters {
+public:
+    enum Event { CYCLES, INSTRUCTIONS, BRANCH_MISSES, L1D_MISSES, LLC_MISSES, EVENT_COUNT };
+
+    // Counts since start(); a negative count means the event is unavailable.
+    struct Reading {
+        double counts[EVENT_COUNT];
+    };
+
+    HardwareCounters() {
+        std::fill(std::begin(fds), std::end(fds), -1);
+#if CALCULATOR_HAVE_PERF_EVENT
+        auto cache = [](uint64_t cache) {
+            return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        };
+        const std::pair<uint32_t, uint64_t> events[EVENT_COUNT] = {
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+            {PERF_TYPE_HW_CACHE, cache(PERF_COUNT_HW_CACHE_L1D)},
+            {PERF_TYPE_HW_CACHE, cache(PERF_COUNT_HW_CACHE_LL)},
+        };
+        int error = 0;
+        for (int i = 0; i < EVENT_COUNT; ++i) {
+            perf_event_attr attributes;
+            std::memset(&attributes, 0, sizeof(attributes));
+            attributes.size = sizeof(attributes);
+            attributes.type = events[i].first;
+            attributes.config = events[i].second;
+            attributes.disabled = 1;
+            attributes.exclude_kernel = 1;  // Allowed at perf_event_paranoid 2.
+            attributes.exclude_hv = 1;
+            // Events may share a counter; the times let stop() scale the count.
+            attributes.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fds[i] = static_cast<int>(syscall(__NR_perf_event_open, &attributes, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+            if (fds[i] < 0) error = errno;
+        }
+        if (!available()) {
+            reason = std::string("perf_event_open failed: ") + std::strerror(error);
+        }
+#else
+        reason = "perf_event_open is not supported on this system";
+#endif
+    }
+
+    ~HardwareCounters() {
+#if CALCULATOR_HAVE_PERF_EVENT
+        for (int fd : fds) {
+            if (fd >= 0) close(fd);
+        }
+#endif
+    }
+
+    HardwareCounters(const HardwareCounters&) = delete;
+    HardwareCounters& operator=(const HardwareCounters&) = delete;
+
+    bool available() const {
+        return std::any_of(std::begin(fds), std::end(fds), [](int fd) { return fd >= 0; });
+    }
+
+    bool available(Event event) const { return fds[event] >= 0; }
+
+    const std::string& unavailableReason() const { return reason; }
+
+    static const char* name(Event event) {
+        static const char* const names[EVENT_COUNT] = {"cycles", "instructions", "branch misses", "L1D misses",
+                                                       "LLC misses"};
+        return names[event];
+    }
+
+    void start() {
+#if CALCULATOR_HAVE_PERF_EVENT
+        for (int fd : fds) {
+            if (fd < 0) continue;
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    Reading stop() {
+        Reading reading;
+        std::fill(std::begin(reading.counts), std::end(reading.counts), -1.0);
+#if CALCULATOR_HAVE_PERF_EVENT
+        for (int i = 0; i < EVENT_COUNT; ++i) {
+            if (fds[i] < 0) continue;
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+            uint64_t values[3];  // Count, time enabled, time running.
+            if (read(fds[i], values, sizeof(values)) == static_cast<ssize_t>(sizeof(values)) && values[2] > 0) {
+                reading.counts[i] = static_cast<double>(values[0]) * values[1] / values[2];
+            }
+        }
+#endif
+        return reading;
+    }
+
+private:
+    int fds[EVENT_COUNT];
+    std::string reason;  // Why no event could be opened.
+};
+
+// Time fn in milliseconds, taking the best of a few runs.
+template <typename Function>
+double timeMilliseconds(Function fn, int runs = 3) {
+    double best = std::numeric_limits<double>::max();
+    for (int i = 0; i < runs; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+    return best;
+}
+
+// Compare Karatsuba against schoolbook multiplication and time decimal conversion.
+void benchmarkBigInteger() {
+    std::mt19937 random(348);
+    std::cout << "\nBig integer multiplication (best of 3, ms)\n";
+    std::cout << std::setw(10) << "digits" << std::setw(14) << "schoolbook" << std::setw(14) << "karatsuba"
+              << std::setw(14) << "to decimal" << std::setw(14) << "from decimal" << "\n";
+    for (size_t digits : {1000, 10000, 100000}) {
+        std::string left, right;
+        for (size_t i = 0; i < digits; ++i) {
+            left += static_cast<char>('1' + random() % 9);
+            right += static_cast<char>('1' + random() % 9);
+        }
+        BigInteger a = BigInteger::fromDecimal(left), b = BigInteger::fromDecimal(right);
+        BigInteger product, check;
+
+        size_t threshold = BigInteger::karatsubaThreshold;
+        BigInteger::karatsubaThreshold = std::numeric_limits<size_t>::max();
+        double schoolbook = timeMilliseconds([&] { check = a * b; });
+        BigInteger::karatsubaThreshold = threshold;
+        double karatsuba = timeMilliseconds([&] { product = a * b; });
+
+        std::string text;
+        BigInteger parsed;
+        double toDecimal = timeMilliseconds([&] { text = product.toDecimal(); });
+        double fromDecimal = timeMilliseconds([&] { parsed = BigInteger::fromDecimal(text); });
+        bool matches = (check - product).isZero() && (parsed - product).isZero();
+
+        std::cout << std::setw(10) << digits << std::fixed << std::setprecision(3)
+                  << std::setw(14) << schoolbook << std::setw(14) << karatsuba
+                  << std::setw(14) << toDecimal << std::setw(14) << fromDecimal
+                  << (matches ? "" : "  MISMATCH") << "\n";
+        std::cout.unsetf(std::ios::fixed);
+    }
+}
+
+// Print p50/p99/p99.9 of a set of latencies given in nanoseconds.
+void printPercentiles(const std::string& label, std::vector<double> latencies) {
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double q) {
+        return latencies[std::min(latencies.size() - 1, static_cast<size_t>(q * latencies.size()))] / 1000.0;
+    };
+    std::cout << std::setw(16) << label << std::fixed << std::setprecision(2)
+              << std::setw(12) << percentile(0.5) << std::setw(12) << percentile(0.99)
+              << std::setw(12) << percentile(0.999) << "\n";
+    std::cout.unsetf(std::ios::fixed);
+}
+
+// Run the tokenizer, the parser and the evaluator over a generated set of
+// expressions, one stage at a time, and report each stage's wall-clock time,
+// hardware counters and, when tracked, allocations per expression and per
+// token (of the tokenizer's output, so the stages are comparable).
+void benchmarkPipeline() {
+    const size_t expressionCount = 2000;
+    const int rounds = 50;
+    std::mt19937 random(1729);
+    std::vector<std::string> expressions;
+    const char* const operators[] = {" + ", " - ", " * ", " / "};
+    for (size_t i = 0; i < expressionCount; ++i) {
+        std::string text;
+        for (int term = 0, terms = 2 + random() % 10; term < terms; ++term) {
+            if (term > 0) text += operators[random() % 4];
+            switch (random() % 4) {
+                case 0: text += std::to_string(1 + random() % 1000); break;
+                case 1: text += std::to_string(random() % 100) + "." + std::to_string(random() % 100); break;
+                case 2: text += "(" + std::to_string(1 + random() % 50) + " + " + std::to_string(random() % 50) + ")"; break;
+                default: text += "-" + std::to_string(1 + random() % 9) + "^2"; break;
+            }
+        }
+        expressions.push_back(text);
+    }
+
+    EnhancedTokenizer tokenizer;
+    ImprovedParser parser;
+    FunctionLibrary functions;
+    RefinedEvaluator<DoubleArithmetic> evaluator;
+    std::vector<std::vector<Token>> tokens(expressionCount);
+    std::vector<std::queue<Token>> parsed(expressionCount);
+    std::vector<double> results(expressionCount);
+    struct Stage {
+        const char* name;
+        PipelineStage stage;
+        std::function<void()> run;
+    };
+    const Stage stages[] = {
+        {"tokenize", PipelineStage::TOKENIZE, [&] { for (size_t i = 0; i < expressionCount; ++i) tokens[i] = tokenizer.tokenize(expressions[i]); }},
+        {"parse", PipelineStage::PARSE, [&] { for (size_t i = 0; i < expressionCount; ++i) parsed[i] = parser.parse(functions.inlineCalls(tokens[i])); }},
+        {"evaluate", PipelineStage::EVALUATE, [&] { for (size_t i = 0; i < expressionCount; ++i) results[i] = evaluator.evaluate(parsed[i]); }},
+    };
+
+    HardwareCounters counters;
+    stages[0].run();  // Fills tokens, so the token count is known.
+    size_t tokenCount = 0;
+    for (const auto& expressionTokens : tokens) tokenCount += expressionTokens.size();
+
+    std::cout << "\nPipeline stages over " << expressionCount << " expressions (" << tokenCount << " tokens), "
+              << rounds << " rounds\n";
+    if (!counters.available()) {
+        std::cout << "Hardware counters unavailable (" << counters.unavailableReason() << "); wall-clock time only\n";
+    }
+    std::cout << std::setw(10) << "stage" << std::setw(12) << "per" << std::setw(10) << "ns";
+    if (AllocationTracker::enabled) {
+        std::cout << std::setw(13) << "allocations" << std::setw(10) << "bytes";
+    }
+    if (counters.available()) {
+        for (int event = 0; event < HardwareCounters::EVENT_COUNT; ++event) {
+            std::cout << std::setw(15) << HardwareCounters::name(static_cast<HardwareCounters::Event>(event));
+        }
+        std::cout << std::setw(8) << "IPC";
+    }
+    std::cout << "\n";
+
+    for (const Stage& stage : stages) {
+        stage.run();  // Warm up, and fill the next stage's input.
+        AllocationTracker::reset();
+        counters.start();
+        auto start = std::chrono::steady_clock::now();
+        {
+            AllocationTracker::Scope scope(stage.stage);
+            for (int round = 0; round < rounds; ++round) stage.run();
+        }
+        double nanoseconds = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        HardwareCounters::Reading reading = counters.stop();
+        AllocationStatistics allocations = AllocationTracker::statistics(stage.stage);
+
+        for (size_t units : {expressionCount, tokenCount}) {
+            double scale = 1.0 / (static_cast<double>(units) * rounds);
+            std::cout << std::setw(10) << (units == expressionCount ? stage.name : "")
+                      << std::setw(12) << (units == expressionCount ? "expression" : "token")
+                      << std::fixed << std::setprecision(1) << std::setw(10) << nanoseconds * scale;
+            if (AllocationTracker::enabled) {
+                std::cout << std::setw(13) << allocations.allocations * scale << std::setw(10) << allocations.bytes * scale;
+            }
+            if (counters.available()) {
+                for (double count : reading.counts) {
+                    if (count < 0) {
+                        std::cout << std::setw(15) << "-";
+                    } else {
+                        std::cout << std::setw(15) << count * scale;
+                    }
+                }
+                double cycles = reading.counts[HardwareCounters::CYCLES];
+                double instructions = reading.counts[HardwareCounters::INSTRUCTIONS];
+                std::cout << std::setprecision(2) << std::setw(8);
+                if (cycles > 0 && instructions >= 0) {
+                    std::cout << instructions / cycles;
+                } else {
+                    std::cout << "-";
+                }
+            }
+            std::cout << "\n";
+            std::cout.unsetf(std::ios::fixed);
+        }
+    }
+}
+
+#ifdef __linux__
+// Compare round-trip latency of the shared-memory ring against a Unix socket,
+// each talking to an evaluator in a child process.
+void benchmarkTransports() {
+    const int requests = 20000;
+    const std::string expression = "(1 + 2) * 3 - 4 / 5";
+    CalculatorSettings settings;
+    SharedMessage message;
+    std::vector<double> latencies(requests);
+
+    std::cout << "\nRound-trip latency of '" << expression << "' (" << requests << " requests, us)\n";
+    std::cout << std::setw(16) << "transport" << std::setw(12) << "p50" << std::setw(12) << "p99"
+              << std::setw(12) << "p99.9" << "\n";
+
+    std::string name = "/calculator-benchmark-" + std::to_string(getpid());
+    SharedChannel* channel = mapSharedChannel(name, true);
+    pid_t server = fork();
+    if (server == 0) {
+        serveChannel(*channel, settings);
+        _exit(0);
+    }
+    for (int i = 0; i < requests; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        message.assign(expression);
+        channel->requests.push(message);
+        channel->responses.pop(message);
+        latencies[i] = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    }
+    message.length = SharedMessage::shutdown;
+    channel->requests.push(message);
+    waitpid(server, nullptr, 0);
+    munmap(channel, sizeof(SharedChannel));
+    shm_unlink(name.c_str());
+    printPercentiles("shared memory", latencies);
+
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+        std::cout << std::setw(16) << "unix socket" << "  unavailable\n";
+        return;
+    }
+    server = fork();
+    if (server == 0) {
+        close(sockets[0]);
+        serveSocket(sockets[1], settings);
+        _exit(0);
+    }
+    close(sockets[1]);
+    for (int i = 0; i < requests; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        message.assign(expression);
+        writeFully(sockets[0], &message, sizeof(message.length) + message.length);
+        readFully(sockets[0], &message.length, sizeof(message.length));
+        readFully(sockets[0], message.text, message.length);
+        latencies[i] = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    }
+    close(sockets[0]);
+    waitpid(server, nullptr, 0);
+    printPercentiles("unix socket", latencies);
+}
+#endif
+
+// Run the benchmarks selected by "--benchmark" on the command line.
+void runBenchmarks() {
+    benchmarkPipeline();
+    benchmarkBigInteger();
+#ifdef __linux__
+    benchmarkTransports();
+#endif
+}
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+// Coroutine that hands the result of one evaluateAsync call to a promise, so
+// the self-test can wait for it from an ordinary function.
+struct DetachedEvaluation {
+    struct promise_type {
+        DetachedEvaluation get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+DetachedEvaluation awaitEvaluation(std::string expression, const FunctionLibrary& functions,
+                                   const CalculatorSettings& settings, CancellationToken cancellation,
+                                   std::promise<std::string>& result) {
+    result.set_value(co_await evaluateAsync(std::move(expression), functions, settings, std::move(cancellation)));
+}
+
+std::string evaluateThroughCoroutine(const std::string& expression, const FunctionLibrary& functions,
+                                     const CalculatorSettings& settings,
+                                     CancellationToken cancellation = CancellationToken()) {
+    std::promise<std::string> result;
+    std::future<std::string> future = result.get_future();
+    awaitEvaluation(expression, functions, settings, std::move(cancellation), result);
+    return future.get();
+}
+#endif
+
+// Print the outcome of one self-test check and count it if it failed.
+void reportCheck(const std::string& name, bool passed, const std::string& detail, int& failures) {
+    std::cout << (passed ? "PASS " : "FAIL ") << name;
+    if (!passed) std::cout << ": " << detail;
+    std::cout << "\n";
+    failures += !passed;
+}
+
+// Evaluate the prepared RPN of expression repeatedly with the evaluator that
+// evaluateWith uses on this thread, and return the allocations made after the
+// first run, which sizes its stack. Preparing the RPN and formatting the
+// result are not counted; they allocate on every evaluateInMode call.
+template <typename Arithmetic>
+uint64_t allocationsWhenWarm(const std::string& expression, Arithmetic arithmetic) {
+    EnhancedTokenizer tokenizer;
+    ImprovedParser parser;
+    std::vector<Token> tokens = reduceConstantDivisors(
+        resolveExponents(parser.parse(tokenizer.tokenize(expression)), arithmetic), arithmetic, false);
+    RefinedEvaluator<Arithmetic>& evaluator = threadEvaluator(arithmetic, nullptr, 0);
+    evaluator.evaluate(tokens);
+
+    AllocationTracker::Scope scope(PipelineStage::EVALUATE);
+    uint64_t before = AllocationTracker::statistics(PipelineStage::EVALUATE).allocations;
+    for (int i = 0; i < 1000; ++i) threadEvaluator(arithmetic, nullptr, 0).evaluate(tokens);
+    return AllocationTracker::statistics(PipelineStage::EVALUATE).allocations - before;
+}
+
+// Check behaviour that ordinary use does not exercise ("--self-test"). Each
+// check prints PASS, FAIL or SKIP; the exit status is 1 if any failed.
+int runSelfTest() {
+    int failures = 0;
+
+    // Re-evaluating prepared RPN with a warm evaluator is the allocation-free
+    // fast path.
+    if (AllocationTracker::enabled) {
+        uint64_t count = allocationsWhenWarm("(1.5 + 2) * 3 - 4 / 5 ^ 2 + -(7 % 3)", DoubleArithmetic());
+        reportCheck("real warm evaluator on prepared RPN does not allocate", count == 0, std::to_string(count) + " allocations", failures);
+        count = allocationsWhenWarm("(15 + 2) * 3 - 40 / 7 ^ 2 + -(7 % 3) + 0xFF", IntegerArithmetic());
+        reportCheck("integer warm evaluator on prepared RPN does not allocate", count == 0, std::to_string(count) + " allocations", failures);
+        count = allocationsWhenWarm("(15 + 2) * 3 - 40 / 7 ^ (2 + 3) + -(7 % 3)", ModularArithmetic(1000003));
+        reportCheck("modular warm evaluator on prepared RPN does not allocate", count == 0, std::to_string(count) + " allocations", failures);
+    } else {
+        std::cout << "SKIP allocation-free warm evaluator: needs a build with -DCALCULATOR_TRACK_ALLOCATIONS=1\n";
+    }
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+    {
+        FunctionLibrary functions;
+        CalculatorSettings settings;
+        std::string result = evaluateThroughCoroutine("(1 + 2) * 3", functions, settings);
+        reportCheck("async evaluation inline", result == "9", result, failures);
+
+        // Costly enough to run on the background pool.
+        std::string sum = "1";
+        size_t terms = 1;
+        while (EvaluationAwaitable::estimateCost(sum, functions, settings) < EvaluationAwaitable::poolCostThreshold) {
+            sum += " + 1";
+            ++terms;
+        }
+        result = evaluateThroughCoroutine(sum, functions, settings);
+        reportCheck("async evaluation on the pool", result == std::to_string(terms), result, failures);
+
+        // The estimate counts what a call expands to, not the call's text.
+        FunctionLibrary library;
+        EnhancedTokenizer tokenizer;
+        library.define("def total(x) = " + sum + " + x", tokenizer);
+        size_t cost = EvaluationAwaitable::estimateCost("total(1)", library, settings);
+        reportCheck("async cost counts inlined calls", cost >= EvaluationAwaitable::poolCostThreshold,
+                    std::to_string(cost), failures);
+        CalculatorSettings bigSettings;
+        bigSettings.mode = NumericMode::BIG_INTEGER;
+        size_t realCost = EvaluationAwaitable::estimateCost("3 ^ 100000", library, settings);
+        cost = EvaluationAwaitable::estimateCost("3 ^ 100000", library, bigSettings);
+        reportCheck("async cost weights big integer powers", cost > realCost,
+                    std::to_string(cost) + " <= " + std::to_string(realCost), failures);
+
+        CancellationToken cancellation;
+        cancellation.cancel();
+        result = evaluateThroughCoroutine(sum, functions, settings, cancellation);
+        reportCheck("async evaluation cancelled", result.find("cancelled") != std::string::npos, result, failures);
+    }
+#else
+    std::cout << "SKIP async evaluation: coroutines need a C++20 build (-std=c++20)\n";
+#endif
+    return failures == 0 ? 0 : 1;
+}
+
+// Re-evaluate every expression of an exported history ("--replay file") with
+// the current pipeline, in the original order so definitions apply as they
+// did, and each row in the mode it was recorded in. Results are compared by
+// error code and by the value as evaluated; version 1 files only hold the
+// value as displayed, so for them only the codes are compared. Reports
+// throughput, per-stage latency percentiles and the mismatches. Returns 1 on
+// any mismatch and 2 if the throughput is below minThroughput expressions per
+// second (when given), so it can gate upgrades. Settings other than the mode
+// (limits, memo, fast math) come from the command line.
+int runReplay(const std::string& path, const CalculatorSettings& settings, double minThroughput) {
+    ColumnarHistory recorded;
+    try {
+        recorded = ColumnarHistory::read(path);
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+
+    EnhancedTokenizer tokenizer;
+    ImprovedParser parser;
+    FunctionLibrary functions;
+    ExpressionCache cache;
+    size_t rows = recorded.expressionIds.size();
+    bool recordedModes = !recorded.modes.empty();
+    std::vector<double> tokenizeTimes, parseTimes, evaluateTimes;
+    tokenizeTimes.reserve(rows);
+    parseTimes.reserve(rows);
+    evaluateTimes.reserve(rows);
+    std::vector<size_t> mismatches;
+    using Clock = std::chrono::steady_clock;
+
+    CalculatorSettings rowSettings = settings;
+    auto start = Clock::now();
+    for (size_t row = 0; row < rows; ++row) {
+        const std::string& expression = recorded.expressions[recorded.expressionIds[row]];
+        if (recordedModes) {
+            rowSettings.mode = static_cast<NumericMode>(recorded.modes[row]);
+            rowSettings.modulus = recorded.moduli[row];
+        }
+        double value;
+        StageTimings timings;
+        std::string result = evaluateExpression(expression, functions, tokenizer, parser, rowSettings, &cache,
+                                                nullptr, &value, &timings);
+        if (timings.tokenize >= 0) tokenizeTimes.push_back(timings.tokenize);
+        if (timings.parse >= 0) parseTimes.push_back(timings.parse);
+        if (timings.evaluate >= 0) evaluateTimes.push_back(timings.evaluate);
+
+        ResultCode code = classifyResult(result, rowSettings.mode);
+        double expected = recorded.results[row];
+        bool sameValue = !recordedModes || value == expected || (std::isnan(value) && std::isnan(expected));
+        if (static_cast<uint8_t>(code) != recorded.codes[row] || !sameValue) {
+            mismatches.push_back(row);
+            if (mismatches.size() <= 20) {
+                std::cout << "Mismatch at row " << row << ": " << expression << " gave '" << result
+                          << "', recorded code " << int(recorded.codes[row]) << " value " << expected << "\n";
+            }
+        }
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    double throughput = seconds > 0 ? rows / seconds : 0.0;
+
+    std::cout << rows << " expressions replayed in " << seconds << " s (" << throughput << " expressions/s), "
+              << mismatches.size() << " mismatch(es)\n";
+    printMemoStatistics(std::cout);
+    printAllocationStatistics(std::cout);
+    std::cout << std::setw(16) << "stage (us)" << std::setw(12) << "p50" << std::setw(12) << "p99"
+              << std::setw(12) << "p99.9" << "\n";
+    if (!tokenizeTimes.empty()) printPercentiles("tokenize", tokenizeTimes);
+    if (!parseTimes.empty()) printPercentiles("inline+parse", parseTimes);
+    if (!evaluateTimes.empty()) printPercentiles("evaluate", evaluateTimes);
+
+    if (!mismatches.empty()) return 1;
+    if (minThroughput > 0 && throughput < minThroughput) {
+        std::cout << "Throughput is below the required " << minThroughput << " expressions/s\n";
+        return 2;
+    }
+    return 0;
+}
+
+// Split a CSV line on commas, trimming spaces around each field.
+std::vector<std::string> splitCsvLine(const std::string& line) {
+    std::vector<std::string> fields;
+    size_t start = 0;
+    while (true) {
+        size_t comma = line.find(',', start);
+        std::string field = line.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+        size_t first = field.find_first_not_of(" \t\r");
+        size_t last = field.find_last_not_of(" \t\r");
+        fields.push_back(first == std::string::npos ? "" : field.substr(first, last - first + 1));
+        if (comma == std::string::npos) break;
+        start = comma + 1;
+    }
+    return fields;
+}
+
+// Evaluate many formulas over the columns of a CSV file in one fused pass
+// ("--columns input.csv formulas.txt output.csv"). The first CSV line names
+// the columns; the formulas file holds one formula per line and may define
+// functions first. A line "where predicate" keeps only the rows where the
+// predicate holds, e.g. "where price * qty > 100". The output has one column
+// per formula, headed by the formula text. "--estrin" and "--fma" after the
+// paths select how polynomials are evaluated, and "--reciprocal-division"
+// divides by any constant through its reciprocal.
+int runColumns(const std::string& inputPath, const std::string& formulasPath, const std::string& outputPath,
+               ColumnarOptions options) {
+    std::ifstream input(inputPath);
+    std::ifstream formulasFile(formulasPath);
+    if (!input || !formulasFile) {
+        std::cerr << "Error: Cannot open '" << (input ? formulasPath : inputPath) << "'\n";
+        return 1;
+    }
+
+    EnhancedTokenizer tokenizer;
+    FunctionLibrary functions;
+    std::vector<std::string> formulas;
+    std::string filter;
+    std::string line;
+    try {
+        while (std::getline(formulasFile, line)) {
+            if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+            if (FunctionLibrary::isDefinition(line)) {
+                functions.define(line, tokenizer);
+            } else if (line.rfind("where ", 0) == 0) {
+                if (!filter.empty()) {
+                    throw std::runtime_error("Error: Only one 'where' line is allowed");
+                }
+                filter = line.substr(6);
+            } else {
+                formulas.push_back(line);
+            }
+        }
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+
+    std::vector<std::string> columns;
+    if (std::getline(input, line)) columns = splitCsvLine(line);
+    std::vector<std::vector<double>> inputs(columns.size());
+    for (size_t row = 2; std::getline(input, line); ++row) {
+        if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+        std::vector<std::string> fields = splitCsvLine(line);
+        if (fields.size() != columns.size()) {
+            std::cerr << "Error: Line " << row << " has " << fields.size() << " fields, expected " << columns.size() << "\n";
+            return 1;
+        }
+        for (size_t c = 0; c < fields.size(); ++c) {
+            double value = 0.0;
+            const char* end = fields[c].data() + fields[c].size();
+            auto parsed = std::from_chars(fields[c].data(), end, value);
+            if (parsed.ec != std::errc() || parsed.ptr != end) {
+                std::cerr << "Error: Malformed number '" << fields[c] << "' on line " << row << "\n";
+                return 1;
+            }
+            inputs[c].push_back(value);
+        }
+    }
+
+    std::vector<std::vector<double>> outputs;
+    using Clock = std::chrono::steady_clock;
+    auto start = Clock::now();
+    try {
+        if (options.fusedMultiplyAdd && !ColumnarProgram::hardwareFma) {
+            std::cerr << "Note: this build has no hardware fused multiply-add; using multiply and add\n";
+        }
+        ColumnarProgram program(columns, formulas, functions, filter, options);
+        size_t kept = program.evaluate(inputs, outputs);
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        size_t rows = inputs.empty() ? 0 : inputs.front().size();
+        std::cerr << rows << " rows x " << formulas.size() << " formulas in " << seconds << " s, "
+                  << kept << " rows kept ("
+                  << program.instructionCount() << " shared instructions, " << program.slotCount()
+                  << " block buffers, " << program.polynomialCount() << " polynomial(s) rewritten)\n";
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+
+    std::ofstream output(outputPath);
+    for (size_t f = 0; f < formulas.size(); ++f) {
+        // Quote formulas such as "f(a, b)" that contain commas.
+        bool quote = formulas[f].find(',') != std::string::npos;
+        output << (f ? "," : "") << (quote ? "\"" : "") << formulas[f] << (quote ? "\"" : "");
+    }
+    output << "\n";
+    size_t rows = outputs.empty() ? 0 : outputs.front().size();  // Rows kept by the filter.
+    char buffer[32];
+    for (size_t row = 0; row < rows; ++row) {
+        for (size_t f = 0; f < outputs.size(); ++f) {
+            // Shortest text that reads back as the same double.
+            auto written = std::to_chars(buffer, buffer + sizeof(buffer), outputs[f][row]);
+            if (f) output << ',';
+            output.write(buffer, written.ptr - buffer);
+        }
+        output << '\n';
+    }
+    return output ? 0 : 1;
+}
+
+// Keep a sheet of cells from commands on standard input ("--sheet"):
+// "name = formula" sets a cell and prints every cell that was recomputed,
+// "def ..." defines a function, "show" lists all cells, and any other line
+// is evaluated over the current cell values.
+int runSheet() {
+    EnhancedTokenizer tokenizer;
+    FunctionLibrary functions;
+    CellSheet sheet(functions);
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos) continue;
+        size_t equals = line.find('=');
+        size_t nameEnd = line.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_", first);
+        bool assignment = equals != std::string::npos && (equals + 1 == line.size() || line[equals + 1] != '=') &&
+                          nameEnd > first && !std::isdigit(static_cast<unsigned char>(line[first])) &&
+                          line.find_first_not_of(" \t", nameEnd) == equals;
+        try {
+            if (FunctionLibrary::isDefinition(line)) {
+                std::cout << "Defined " << functions.define(line, tokenizer) << "\n";
+            } else if (line.compare(first, std::string::npos, "show") == 0) {
+                for (size_t id = 0; id < sheet.size(); ++id) std::cout << sheet.describe(id) << "\n";
+            } else if (assignment) {
+                auto start = std::chrono::steady_clock::now();
+                std::vector<size_t> computed = sheet.set(line.substr(first, nameEnd - first), line.substr(equals + 1));
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                for (size_t id : computed) std::cout << sheet.describe(id) << "\n";
+                std::cout << "(" << computed.size() << " of " << sheet.size() << " cells recomputed in "
+                          << seconds * 1e3 << " ms)\n";
+            } else {
+                std::cout << sheet.evaluate(line) << "\n";
+            }
+        } catch (const std::runtime_error& e) {
+            std::cout << e.what() << "\n";
+        }
+    }
+    return 0;
+}
+
+// Read "--mode NAME", "--timeout-ms N", "--max-operations N",
+// "--reciprocal-division", "--memo", "--no-memo" and "--fast-math" from argv[first...] into settings. Modes are real,
+// integer, rational, bigint, interval and modular=M. Returns false on an
+// unknown option.
+bool parseSettingsOptions(int argc, char* argv[], int first, CalculatorSettings& settings) {
+    for (int i = first; i < argc; i += 2) {
+        std::string option = argv[i];
+        std::string value = i + 1 < argc ? argv[i + 1] : "";
+        if (option == "--timeout-ms" && !value.empty()) {
+            settings.timeoutMilliseconds = std::strtoull(value.c_str(), nullptr, 10);
+        } else if (option == "--reciprocal-division") {
+            settings.reciprocalDivision = true;
+            --i;  // Takes no value.
+        } else if (option == "--memo") {
+            settings.memoizeSubexpressions = true;
+            --i;  // Takes no value.
+        } else if (option == "--no-memo") {
+            settings.memoizeSubexpressions = false;
+            --i;  // Takes no value.
+        } else if (option == "--fast-math") {
+            settings.fastMath = true;
+            --i;  // Takes no value.
+        } else if (option == "--max-operations" && !value.empty()) {
+            settings.maxOperations = std::strtoull(value.c_str(), nullptr, 10);
+        } else if (option == "--mode" && value == "real") {
+            settings.mode = NumericMode::REAL;
+        } else if (option == "--mode" && value == "integer") {
+            settings.mode = NumericMode::INTEGER;
+        } else if (option == "--mode" && value == "rational") {
+            settings.mode = NumericMode::RATIONAL;
+        } else if (option == "--mode" && value == "bigint") {
+            settings.mode = NumericMode::BIG_INTEGER;
+        } else if (option == "--mode" && value == "interval") {
+            settings.mode = NumericMode::INTERVAL;
+        } else if (option == "--mode" && value.rfind("modular=", 0) == 0 &&
+                   std::strtoull(value.c_str() + 8, nullptr, 10) >= 2) {
+            settings.mode = NumericMode::MODULAR;
+            settings.modulus = std::strtoull(value.c_str() + 8, nullptr, 10);
+        } else {
+            std::cerr << "Error: Invalid option '" << option << (value.empty() ? "" : " " + value) << "'\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Main program function.
+int main(int argc, char* argv[]) {
+    if (argc > 1 && std::string(argv[1]) == "--benchmark") {
+        runBenchmarks();
+        return 0;
+    }
+    if (argc > 2 && std::string(argv[1]) == "--replay") {
+        // An optional minimum throughput may follow the file name.
+        CalculatorSettings settings;
+        bool hasMinimum = argc > 3 && std::string(argv[3]).rfind("--", 0) != 0;
+        double minThroughput = hasMinimum ? std::strtod(argv[3], nullptr) : 0.0;
+        return parseSettingsOptions(argc, argv, hasMinimum ? 4 : 3, settings) ? runReplay(argv[2], settings, minThroughput) : 1;
+    }
+    if (argc > 1 && std::string(argv[1]) == "--self-test") {
+        return runSelfTest();
+    }
+    if (argc > 1 && std::string(argv[1]) == "--sheet") {
+        return runSheet();
+    }
+    if (argc > 4 && std::string(argv[1]) == "--columns") {
+        ColumnarOptions options;
+        for (int i = 5; i < argc; ++i) {
+            std::string option = argv[i];
+            if (option == "--estrin") {
+                options.estrin = true;
+            } else if (option == "--fma") {
+                options.fusedMultiplyAdd = true;
+            } else if (option == "--reciprocal-division") {
+                options.reciprocalDivision = true;
+            } else {
+                std::cerr << "Error: Invalid option '" << option << "'\n";
+                return 1;
+            }
+        }
+        return runColumns(argv[2], argv[3], argv[4], options);
+    }
+#ifdef __linux__
+    if (argc > 2 && std::string(argv[1]) == "--serve-shm") {
+        CalculatorSettings settings;
+        return parseSettingsOptions(argc, argv, 3, settings) ? serveSharedMemory(argv[2], settings) : 1;
+    }
+    if (argc > 2 && std::string(argv[1]) == "--shm-client") {
+        return runSharedMemoryClient(argv[2]);
+    }
+    if (argc > 3 && std::string(argv[1]) == "--batch") {
+        CalculatorSettings settings;
+        return parseSettingsOptions(argc, argv, 4, settings) ? runBatch(argv[2], argv[3], settings) : 1;
+    }
+#endif
+
+    EnhancedTokenizer tokenizer;    
+    ImprovedParser parser;
+    CalculatorSettings settings;
+    if (!parseSettingsOptions(argc, argv, 1, settings)) {
+        return 1;
+    }
+    CalculatorHistory history;
+    FunctionLibrary functions;
+
+    int option = 0;
+    do {
+        printMenu();  // Display the main menu
+        option = readMenuOption();
+
+        // Handling user menu selection
+        switch (option) {
+            case 1:
+                handleExpression(history, functions, tokenizer, parser, settings);  // Enter and evaluate an expression
+                break;
+            case 2:
+                showHistory(history, functions);  // Display history of expressions and results
+                break;
             case 3:
                 showUserManual();  // Show user manual
                 break;
             case 4:
+                selectMode(settings);  // Choose the numeric mode
+                break;
+            case 5:
+                searchHistory(history);  // Find entries in the history
+                break;
+            case 6:
+                exportHistory(history);  // Save the history for analysis
+                break;
+            case 7:
+                showStatistics();  // Show cache statistics
+                break;
+            case 0:
                 std::cout << "\n--------------------------------------------------------------------------------\n";
                 std::cout << "\nProgram has ended.\n";  // Quit the program
                 std::cout << "\n--------------------------------------------------------------------------------\n";
@@ -337,7 +6033,7 @@ int main() {
                 std::cout << "\nInvalid option. Please try again.\n";  // Handle invalid menu option
                 break;
         }
-    } while (option != 4);
+    } while (option != 0);
 
     return 0;  // End of main function
 }